@@ -2,13 +2,14 @@
 #include <stdio.h>
 #include <stdbool.h>
 #include <string.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 #include <pthread.h>
+#include <signal.h>
 #include <time.h>
 
 #include <kdg/kdgu.h>
-#include <curl/curl.h>
 
 #include "lisp/lex.h"
 #include "lisp/lisp.h"
@@ -24,19 +25,64 @@
 #include "irc.h"
 #include "lisp.h"
 #include "util.h"
+#include "image.h"
+#include "paste.h"
 
 #include "birch.h"
 
+/* The longest reply `birch_send' will send or paste, in bytes. */
+#define OUTPUT_MAX 10000
+
+/* The longest host name a server might relay our messages with. */
+#define HOST_MAX 63
+
 struct birch *
 birch_new(void)
 {
 	struct birch *b = malloc(sizeof *b);
 	memset(b, 0, sizeof *b);
+	pthread_mutex_init(&b->lock, NULL);
 	b->env = new_environment(b, "global", "global");
 	lisp_init(b);
 	return b;
 }
 
+/*
+ * Returns a bot restored from the heap image at `path`, or NULL if
+ * there is no usable image or the configuration file `config` has
+ * changed since it was written.
+ */
+
+struct birch *
+birch_restore(const char *path, const char *config)
+{
+	struct stat image, conf;
+
+	if (stat(path, &image)
+	    || (!stat(config, &conf) && conf.st_mtime > image.st_mtime))
+		return NULL;
+
+	struct birch *b = malloc(sizeof *b);
+	memset(b, 0, sizeof *b);
+	pthread_mutex_init(&b->lock, NULL);
+	b->env = empty_environment(b, "global", "global");
+
+	if (image_load(b, path)) {
+		/* Nothing has been allocated beyond the constants. */
+		free(b->env->gc->obj);
+		free(b->env->gc->bmp);
+		free(b->env->gc->mark);
+		free(b->env->gc);
+		free(b->env->server);
+		free(b->env->channel);
+		free(b->env);
+		free(b);
+		return NULL;
+	}
+
+	return b;
+}
+
 struct server *
 birch_connect(struct birch *b,
               const char *network,
@@ -49,6 +95,8 @@ birch_connect(struct birch *b,
 	struct server *s = server_new(b, network, address, port);
 	if (!s) return NULL;
 
+	s->nick = strdup(nick);
+	s->user = strdup(user);
 	list_add(&b->server, s);
 
 	net_send(s->net, "USER %s 0 * :%s\r\n", user, realname);
@@ -70,6 +118,61 @@ birch_join(struct birch *b,
 	return 0;
 }
 
+static void
+reload_config(struct birch *b)
+{
+	struct env *env = b->env;
+	value path = find(env, make_symbol(env, "config-file"));
+
+	if (type(path) == VAL_NIL || type(cdr(path)) != VAL_STRING) {
+		puts("reload error: `config-file' must be a string");
+		return;
+	}
+
+	char *p = tostring(string(cdr(path)));
+	value res = birch_reload(b, p);
+	free(p);
+
+	if (type(res) == VAL_ERROR) {
+		puts("reload error:");
+		puts(tostring(string(res)));
+	}
+}
+
+static void *
+hangup_main(void *data)
+{
+	struct birch *b = data;
+	sigset_t set;
+	sigemptyset(&set);
+	sigaddset(&set, SIGHUP);
+
+	while (1) {
+		int sig;
+		if (sigwait(&set, &sig)) continue;
+		pthread_mutex_lock(&b->lock);
+		reload_config(b);
+		pthread_mutex_unlock(&b->lock);
+	}
+
+	return NULL;
+}
+
+/*
+ * Starts the thread that reloads the configuration on SIGHUP. SIGHUP
+ * must already be blocked in every thread (see main), so it stays
+ * pending until this thread waits for it, and the reload happens under
+ * the interpreter lock whether or not any messages arrive.
+ */
+
+void
+birch_watch_hangup(struct birch *b)
+{
+	pthread_t thread;
+	pthread_create(&thread, NULL, hangup_main, b);
+	pthread_detach(thread);
+}
+
 void *
 birch_main(void *data)
 {
@@ -88,72 +191,121 @@ birch_main(void *data)
 
 		if (line->type == LINE_CMD && line->cmd == CMD_PING) {
 			net_send(server->net, "PONG :%s\r\n", line->trailing);
+			line_free(line);
 			continue;
 		}
 
-		if (line->type != LINE_CMD || line->cmd != CMD_PRIVMSG)
+		if (line->type != LINE_CMD || line->cmd != CMD_PRIVMSG) {
+			line_free(line);
 			continue;
+		}
 
+		pthread_mutex_lock(&b->lock);
 		lisp_interpret_line(b, server->name, line);
+		pthread_mutex_unlock(&b->lock);
 	}
 
 	return NULL;
 }
 
-static size_t
-receive(void *ptr,
-        size_t size,
-        size_t nmemb,
-        char **stream)
-{
-	if (!*stream) {
-		*stream = malloc(size * nmemb + 1);
-		memcpy(*stream, ptr, size * nmemb);
-		(*stream)[size * nmemb] = 0;
-	} else {
-		*stream = realloc(*stream,
-		                  strlen(*stream) + size * nmemb + 1);
-		sprintf(*stream, "%s%.*s", *stream, (int)(size * nmemb), ptr);
-	}
+/*
+ * The server relays a reply to the channel as ":nick!user@host
+ * PRIVMSG chan :text\r\n", and all of that has to fit in
+ * NET_LINE_MAX bytes. Returns how much of that is left for the text.
+ * The host isn't known, so the longest one is assumed, and the user
+ * name may get a `~' in front of it.
+ */
 
-	return size * nmemb;
+static int
+line_room(struct server *s, const char *chan)
+{
+	int prefix = strlen(":!~@ ") + strlen(s->nick) + strlen(s->user)
+		+ HOST_MAX;
+	return NET_LINE_MAX - prefix
+		- (int)strlen("PRIVMSG  :\r\n") - (int)strlen(chan);
 }
 
+/*
+ * Hands `str` to the paste worker, which posts it to `paste-url` and
+ * sends the address of the paste to the channel once it's up.
+ */
+
 void
 birch_paste(struct birch *b,
             const char *server,
             const char *chan,
             const char *str)
 {
-	CURL *curl = curl_easy_init();
-	char *out = NULL, *data = NULL, *buf = NULL;
+	struct server *serv = list_get(b->server,
+	                               (void *)server,
+	                               server_cmp);
+	if (!serv) return;
 
-	if (!curl) goto fail;
-	data = curl_easy_escape(curl, str, strlen(str));
-	if (!data) goto fail;
-	buf = malloc(strlen(data) + 5);
-	if (!buf) goto fail;
+	struct env *env = birch_get_env(b, server, chan);
+	value url = find(env, make_symbol(env, "paste-url"));
 
-	sprintf(buf, "f:1=%s", data);
-	printf("buf: %s\n", buf);
+	if (type(url) == VAL_NIL || type(cdr(url)) != VAL_STRING) {
+		birch_send(b, server, chan, false, "Paste failed.");
+		return;
+	}
 
-	/* TODO: Make the paste site customizable. */
-	curl_easy_setopt(curl, CURLOPT_URL, "ix.io/");
-	curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, receive);
-	curl_easy_setopt(curl, CURLOPT_WRITEDATA, &out);
-	curl_easy_setopt(curl, CURLOPT_POSTFIELDS, buf);
+	char *u = tostring(string(cdr(url)));
+	paste_submit(serv->net, chan, u, str, line_room(serv, chan));
+	free(u);
+}
 
-	if (curl_easy_perform(curl) != CURLE_OK) goto fail;
+/*
+ * Returns the number of lines a reply may take up in the channel
+ * before it's pasted instead, from `max-reply-lines`.
+ */
 
-	birch_send(b, server, chan, false, "%s", out);
-	return;
+static int
+reply_lines(struct birch *b, const char *server, const char *chan)
+{
+	struct env *env = birch_get_env(b, server, chan);
+	value v = find(env, make_symbol(env, "max-reply-lines"));
+	if (type(v) == VAL_NIL || type(cdr(v)) != VAL_INT) return 1;
+	return integer(cdr(v));
+}
 
- fail:
-	birch_send(b, server, chan, false, "Paste failed.");
- cleanup:
-	free(data);
-	free(buf);
-	curl_easy_cleanup(curl);
+/*
+ * Finds the next line to send from `*s` and advances past it. Lines
+ * end at line breaks, or else at the last space or, failing that, the
+ * last whole UTF-8 character that fits in `room` bytes. Every line
+ * holds at least one byte. Returns the length of the line or -1 if
+ * there is nothing left to send.
+ */
+
+static int
+next_line(const char **s, int room, const char **line)
+{
+	const char *p = *s + strspn(*s, "\r\n");
+	if (!*p) return -1;
+
+	int len = strcspn(p, "\r\n"), skip = 0;
+
+	/* Every call must take something, or the callers never stop. */
+	if (room < 1) room = 1;
+
+	if (len > room) {
+		len = room;
+		while (len > 0 && p[len] != ' ') len--;
+
+		if (len) {
+			skip = 1;
+		} else {
+			len = room;
+			while (len > 0 && (p[len] & 0xC0) == 0x80) len--;
+
+			/* Text that isn't UTF-8 is cut anywhere. */
+			if (!len) len = room;
+		}
+	}
+
+	*line = p;
+	*s = p + len + skip;
+
+	return len;
 }
 
 void
@@ -175,45 +327,78 @@ birch_send(struct birch *b,
 		return;
 	}
 
-	int len = 512;
-	char *buf = malloc(len + 1);
+	/*
+	 * TODO: `out-hook' for filtering and other hooks (e.g. to
+	 * control pastes).
+	 */
 
-	while (true) {
-		va_list args;
-		va_start(args, fmt);
-		int ret = vsnprintf(buf, len + 1, fmt, args);
-		va_end(args);
+	/*
+	 * Most replies fit on one line, so the line is built right in
+	 * the connection's send buffer. Only longer replies are
+	 * formatted again into a buffer of their own and split up.
+	 */
+	int room = line_room(serv, chan);
+	char *out = net_reserve(serv->net);
+	int head = snprintf(out, NET_LINE_MAX + 1, "PRIVMSG %s :", chan);
 
-		if (ret < len) break;
+	/* Leave room for at least one whole character per line. */
+	if (room < 4 || head < 0 || head + room + 2 > NET_LINE_MAX) {
+		net_commit(serv->net, 0);
+		return;
+	}
 
-		if ((len *= 2) > 10000) {
-			birch_send(b, server, chan, false,
-			           "Output was too long.");
-			free(buf);
-			return;
-		}
+	va_list args;
+	va_start(args, fmt);
+	int len = vsnprintf(out + head, room + 1, fmt, args);
+	va_end(args);
 
-		/* TODO: Check realloc and stuff. */
-		buf = realloc(buf, len + 1);
+	if (len >= 0 && len <= room
+	    && !memchr(out + head, '\n', len)
+	    && !memchr(out + head, '\r', len)) {
+		memcpy(out + head + len, "\r\n", 2);
+		net_commit(serv->net, head + len + 2);
+		return;
 	}
 
-	/*
-	 * TODO: `out-hook' for filtering and other hooks (e.g. to
-	 * control pastes).
-	 */
+	net_commit(serv->net, 0);
 
-	if (paste && strchr(buf, '\n')) {
-		birch_paste(b, server, chan, buf);
+	if (len < 0) return;
+
+	if (len > OUTPUT_MAX) {
+		birch_send(b, server, chan, false, "Output was too long.");
 		return;
 	}
 
-	char output[513];
-	if (snprintf(output, 513, "PRIVMSG %s :%s\r\n", chan, buf) > 256) {
+	char *buf = malloc(len + 1);
+	va_start(args, fmt);
+	vsnprintf(buf, len + 1, fmt, args);
+	va_end(args);
+
+	int max = reply_lines(b, server, chan), lines = 0;
+	const char *p = buf, *line;
+
+	while (next_line(&p, room, &line) >= 0) lines++;
+
+	if (lines > max && paste) {
 		birch_paste(b, server, chan, buf);
+		free(buf);
 		return;
 	}
 
-	net_send(serv->net, "%s", output);
+	p = buf;
+
+	for (int i = 0; i < max; i++) {
+		int n = next_line(&p, room, &line);
+		if (n < 0) break;
+
+		out = net_reserve(serv->net);
+		head = sprintf(out, "PRIVMSG %s :", chan);
+		memcpy(out + head, line, n);
+		memcpy(out + head + n, "\r\n", 2);
+		net_commit(serv->net, head + n + 2);
+	}
+
+	free(buf);
 }
 
 /*
@@ -252,6 +437,7 @@ birch_get_env(struct birch *b,
 		env = push_env(b->env, NIL, NIL);
 		env->server = strdup(server);
 		env->channel = strdup(channel);
+		env->usage = env->peak = 0;
 		list_add(&b->channel, env);
 		return env;
 	}
@@ -259,11 +445,49 @@ birch_get_env(struct birch *b,
 	env = push_env(birch_get_env(b, server, "global"), NIL, NIL);
 	env->server = strdup(server);
 	env->channel = strdup(channel);
+	env->usage = env->peak = 0;
+	env->store = NULL;
+	env->index = NULL;
+	env->backfill = NULL;
+	env->index_first = env->index_end = 0;
 	list_add(&b->channel, env);
 
 	return env;
 }
 
+/*
+ * Calls `init`, which connects to the servers, once the global
+ * environment has been set up by the configuration or an image.
+ */
+
+int
+birch_start(struct birch *b)
+{
+	struct env *env = b->env;
+
+	/* The server threads `init` starts wait until it's done. */
+	pthread_mutex_lock(&b->lock);
+
+	value init = find(env, make_symbol(env, "init"));
+	/* TODO */
+	if (type(init) == VAL_NIL) exit(1);
+	value call = gc_alloc(env, VAL_CELL);
+
+	car(call) = cdr(init);
+	cdr(call) = NIL;
+
+	value val = eval(env, call);
+
+	if (type(val) == VAL_ERROR) {
+		puts(tostring(string(val)));
+		puts(tostring(string(print_value(env, call))));
+	}
+
+	pthread_mutex_unlock(&b->lock);
+
+	return type(val) == VAL_ERROR;
+}
+
 int
 birch_config(struct birch *b, const char *path)
 {
@@ -272,50 +496,172 @@ birch_config(struct birch *b, const char *path)
 
 	struct env *env = b->env;
 	struct lexer *lexer = new_lexer("*command*", code);
-	value expr = NIL;
+	bool err = false, start = true;
 
-	do {
-		struct token *t = tok(lexer);
+	for (struct token *t; (t = tok(lexer));) {
+		if (t->type != '(') {
+			err = true;
+			break;
+		}
 
-		if (!t) {
-			value init = find(env, make_symbol(env, "init"));
-			/* TODO */
-			if (type(init) == VAL_NIL) exit(1);
-			value call = gc_alloc(env, VAL_CELL);
+		value expr = parse(env, lexer);
 
-			car(call) = cdr(init);
-			cdr(call) = NIL;
+		if (type(expr) == VAL_ERROR) {
+			puts(tostring(string(expr)));
+			err = true;
+			break;
+		}
+
+		pthread_mutex_lock(&b->lock);
+		value val = eval(env, expr);
 
-			value val = eval(env, call);
+		if (type(val) == VAL_ERROR) {
+			puts(tostring(string(val)));
+			puts(tostring(string(print_value(env, expr))));
+			err = true;
+		}
 
-			if (type(val) == VAL_ERROR) {
-				puts(tostring(string(val)));
-				puts(tostring(string(print_value(env, expr))));
-				return 1;
-			}
+		pthread_mutex_unlock(&b->lock);
+		if (err) break;
 
-			return 0;
+		/* An empty form ends the configuration without starting. */
+		if (type(expr) == VAL_NIL) {
+			start = false;
+			break;
 		}
+	}
 
-		if (t->type != '(') return 1;
+	lexer_free(lexer);
+	free(code);
 
-		expr = parse(env, lexer);
+	if (err) return 1;
+	return start ? birch_start(b) : 0;
+}
+
+/*
+ * Returns the binding of the symbol `sym` in the association list
+ * `vars`, or nil.
+ */
+
+static value
+binding(struct env *env, value vars, value sym)
+{
+	for (; type(vars) != VAL_NIL; vars = cdr(vars))
+		if (kdgu_cmp(string(sym), string(car(car(vars))),
+		             false, NULL))
+			return car(vars);
+
+	return NIL;
+}
+
+/*
+ * Evaluates the configuration file `path` again in the global
+ * environment of the running bot, without calling `init`. Nothing is
+ * evaluated unless the whole file parses, and if any form fails every
+ * global variable is put back the way it was. Otherwise each
+ * variable the file defines takes the place of the old binding of the
+ * same name, so a reload doesn't leave shadowed copies behind.
+ * Connections and channel environments aren't touched. Returns t or
+ * the error.
+ */
+
+value
+birch_reload(struct birch *b, const char *path)
+{
+	struct env *env = b->env;
+	char *code = load_file(path);
+
+	if (!code)
+		return error(env, "couldn't read %s", path);
+
+	struct lexer *lexer = new_lexer("*command*", code);
+	value forms = NIL, *tail = &forms, err = NIL;
+
+	for (struct token *t; (t = tok(lexer));) {
+		if (t->type != '(') {
+			err = error(env, "%s: expected `('", path);
+			break;
+		}
+
+		value expr = parse(env, lexer);
 
 		if (type(expr) == VAL_ERROR) {
-			puts(tostring(string(expr)));
-			return 1;
+			err = expr;
+			break;
 		}
 
-		value val = eval(env, expr);
+		*tail = cons(env, expr, NIL);
+		tail = &cdr(*tail);
+	}
 
-		if (type(val) == VAL_ERROR) {
-			puts(tostring(string(val)));
-			puts(tostring(string(print_value(env, expr))));
-			return 1;
+	lexer_free(lexer);
+	free(code);
+
+	if (type(err) == VAL_ERROR) return err;
+
+	/* Remember what every global variable was bound to. */
+	value old = env->vars;
+	int n = 0;
+
+	for (value i = old; type(i) != VAL_NIL; i = cdr(i)) n++;
+
+	value *saved = malloc((n + 1) * sizeof *saved);
+	n = 0;
+
+	for (value i = old; type(i) != VAL_NIL; i = cdr(i))
+		saved[n++] = cdr(car(i));
+
+	value ret = TRUE;
+
+	for (value i = forms; type(i) != VAL_NIL; i = cdr(i)) {
+		value val = eval(env, car(i));
+		if (type(val) != VAL_ERROR) continue;
+		ret = val;
+		break;
+	}
+
+	if (type(ret) == VAL_ERROR) {
+		env->vars = old;
+		n = 0;
+		for (value i = old; type(i) != VAL_NIL; i = cdr(i))
+			cdr(car(i)) = saved[n++];
+		free(saved);
+		return ret;
+	}
+
+	free(saved);
+
+	/*
+	 * Fold the new bindings into the old ones, oldest first, so
+	 * that the last definition of a name wins.
+	 */
+
+	int num_new = 0;
+	for (value i = env->vars; i != old; i = cdr(i)) num_new++;
+
+	value *cell = malloc((num_new + 1) * sizeof *cell);
+	num_new = 0;
+	for (value i = env->vars; i != old; i = cdr(i)) cell[num_new++] = i;
+
+	value vars = old;
+
+	while (num_new--) {
+		value c = cell[num_new];
+		value bind = binding(env, vars, car(car(c)));
+
+		if (type(bind) != VAL_NIL) {
+			cdr(bind) = cdr(car(c));
+			continue;
 		}
-	} while (type(expr) != VAL_NIL);
 
-	return 0;
+		cdr(c) = vars;
+		vars = c;
+	}
+
+	free(cell);
+	env->vars = vars;
+
+	return TRUE;
 }
 
 void
@@ -325,8 +671,10 @@ send_value(struct birch *b,
            const char *channel,
            value v)
 {
+	/* Anything past what `birch_send' accepts is never printed. */
 	value print = type(v) == VAL_STRING
-		? v : print_value(env, v);
+		? v : print_value_limit(env, v,
+		                        OUTPUT_MAX - strlen(PRINT_MARKER));
 
 	/* TODO: This can only happen when the print itself fails. */
 	if (type(print) == VAL_ERROR) return;
@@ -336,9 +684,6 @@ send_value(struct birch *b,
 	/* TODO: Think about when this can happen. */
 	if (!thing || !thing->s) return;
 
-	char *buf = malloc(thing->len + 1);
-	memcpy(buf, thing->s, thing->len);
-	buf[thing->len] = 0;
-	birch_send(b, server, channel, true, "%s", buf);
-	free(buf);
+	birch_send(b, server, channel, true,
+	           "%.*s", (int)thing->len, thing->s);
 }
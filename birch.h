@@ -1,4 +1,18 @@
+/*
+ * The configuration read at startup and the heap image that replaces
+ * it when it is newer; see `birch_restore`.
+ */
+#define BIRCH_CONFIG "birch.lisp"
+#define BIRCH_IMAGE "birch.image"
+
 struct birch {
+	/*
+	 * Held by whichever thread is using the Lisp heap. All of the
+	 * interpreter's state, the heap and its caches included, is
+	 * shared by every server thread.
+	 */
+	pthread_mutex_t lock;
+
 	/* Low-level server objects. */
 	struct list *server;
 
@@ -7,9 +21,13 @@ struct birch {
 
 	/* Channel-specific Lisp environments. */
 	struct list *channel;
+
+	/* The guards of the `msg-hook' lists that were last run. */
+	struct hook_index *hook_index;
 };
 
 struct birch *birch_new(void);
+struct birch *birch_restore(const char *path, const char *config);
 struct server *birch_connect(struct birch *b,
                              const char *network,
                              const char *address,
@@ -43,8 +61,11 @@ void birch_send(struct birch *b,
 struct env *birch_get_env(struct birch *b,
                           const char *server,
                           const char *channel);
+int birch_start(struct birch *b);
 int birch_config(struct birch *b,
                  const char *path);
+value birch_reload(struct birch *b, const char *path);
+void birch_watch_hangup(struct birch *b);
 void send_value(struct birch *b,
                 struct env *env,
                 const char *server,
@@ -7,12 +7,10 @@
 		 command
 		 log-line
 		 log-line
-                 (lambda (line)
-		   (if (match "ball?anced penalties" "i" (get-body line))
-                       (eval ~(mock ,(get-nick line)))))
-                 (lambda (line)
-		   (cond (match "Please contact this bot" "" (get-body line))
-			 "mnrmnaugh: the boat is broke"))))
+		 ((regex "ball?anced penalties" "i")
+		  . (lambda (line) (eval ~(mock ,(line-nick line)))))
+		 ((regex "Please contact this bot")
+		  . (lambda (line) "mnrmnaugh: the boat is broke"))))
 
 (defq ctcp-hook '((action . log-line)
 		  (action . sed-line)
@@ -25,7 +23,21 @@
 
 (defq trigger ",")
 (defq should-log t)
+(defq max-reply-lines 3)		; Longer replies are pasted.
+(defq paste-url "http://ix.io/")	; Where long replies are pasted.
+(defq history-size 1000)		; Lines of history per channel.
+(defq log-directory "logs")		; On-disk history, or nil.
+(defq log-index nil)			; Trigram-index on-disk history.
+(defq log-segment-size 16384)		; Kilobytes per log segment.
+(defq log-retention-days nil)		; Days of history kept, or nil.
+(defq log-retention-size nil)		; Megabytes kept per channel, or nil.
+(defq log-durability 'periodic)		; none, periodic or group.
+(defq log-commit-interval 50)		; Milliseconds between log writes.
 (defq recursion-limit 512)
+(defq step-limit 200000)		; Per hook invocation.
+(defq time-limit 2000)			; Milliseconds per hook invocation.
+(defq alloc-limit 40000)		; Objects per hook invocation.
+(defq heap-limit 80000)			; Live objects per channel (at most 80000).
 
 (defun init ()
   "Prepare the bot for the main I/O loop."
@@ -44,11 +56,6 @@
   (join "kroknet" "#test")
   (join "kroknet" "#test2"))
 
-(defun get-date (line) (nth line 0))
-(defun get-nick (line) (nth line 1))
-(defun get-body (line) (nth line 2))
-(defun is-action (line) (nth line 3))
-
 (defun lispize-line (input)
   "Returns the expanded form of a message that contains embedded \
 Lisp commands, or nil if it does not contain any embedded Lisp."
@@ -119,7 +126,7 @@ Lisp commands, or nil if it does not contain any embedded Lisp."
   "Processes any user commands embedded within a LINE that has been \
 received from a server. Returns the result of the evaluation(s) or \
 nil, if there were no commands embedded within the line."
-  (let ((msg (get-body line))
+  (let ((msg (line-body line))
 	(regex-match (match (append "^" trigger "(.*)$") "" msg))
 	(regex-match (if regex-match regex-match
 		       (match "^sudo\s+(.*)$" "" msg)))
@@ -148,54 +155,33 @@ nil, if there were no commands embedded within the line."
 Does not initialize anything that has already been initialized. SERV \
 and CHAN are the standard `join-hook' parameters."
   (in (append serv "/" chan) progn
-      ;; Define the `log' variable if it does not already exist.
+      ;; Define the `log' variable if it does not already exist. The
+      ;; history is a ring buffer of the last `history-size' lines,
+      ;; newest first.
       (if (not (boundp 'log))
-	  (defq log nil))
+	  (defq log (make-ring history-size)))
 
       ;; Define the `raw-log' variable if it does not already exist.
       (if (not (boundp 'raw-log))
-	  (defq raw-log nil))))
+	  (defq raw-log (make-ring history-size)))))
 
-(defun find-message (nick pattern &optional mode)
-  "Find the last message in the current channel said by NICK that \
+(defun find-line (nick pattern &optional mode)
+  "Find the last line in the current channel said by NICK that \
 matches PATTERN with the mode string MODE or with the mode string \
-\"\" if MODE is not given. Returns the body of the matching message, \
-or nil if there was no matching message."
-  (let ((node log)			;Current history line.
-	(result nil))			;Return value.
-    ;; Walk along the channel history, stopping only if we reach the
-    ;; end of the history or we've found a result.
-    (while (and node (not result))
-      (let ((regex-match (match pattern
-				(if mode mode "")
-				(nth (car node) 2))))
-
-	;; If the line matches PATTERN and line was said by NICK then
-	;; set `result' to the body of the line.
-	(if (and (if nick (string= (nth (car node) 1) nick) t)
-		 regex-match)
-	    (setq result (nth (car node) 2))))
-
-      ;; Continue on to the next line.
-      (setq node (cdr node)))
-    result))
+\"\" if MODE is not given. Returns the line, or nil if there was no \
+matching line."
+  (let ((line (car (history-search log nick pattern mode 1))))
+    ;; Older lines are only on disk. Skip the ones that are in `log'
+    ;; as well.
+    (if (or line (not log-directory))
+	line
+      (car (log-search nick pattern mode 1 (length log))))))
 
-(defun find-line (nick pattern &optional mode)
-  "Perform the same task as `find-message' but instead of returning \
-the message, return the entire line representation (including nick \
-and date). See the implementation of `find-message' for better \
-documentation."
-  (let ((node log)
-	(result nil))
-    (while (and node (not result))
-      (let ((regex-match (match pattern
-				(if mode mode "")
-				(nth (car node) 2))))
-	(if (and (if nick (string= (nth (car node) 1) nick) t)
-		 regex-match)
-	    (setq result (car node))))
-      (setq node (cdr node)))
-    result))
+(defun find-message (nick pattern &optional mode)
+  "Perform the same task as `find-line' but instead of returning \
+the line, return only its body."
+  (let ((line (find-line nick pattern mode)))
+    (if line (line-body line))))
 
 (defun spongebob (string)
   "Return the Spongebob translation of STRING."
@@ -216,7 +202,7 @@ PATTERN allow you to narrow down your mockage to a particular \
 message."
   (let ((result (if (not nick)
 		    ;; If there's no nick then do the last line.
-		    (spongebob (nth (car log) 2))
+		    (spongebob (line-body (ring-ref log 0)))
 		  ;; Otherwise actually mock the user.
 		  (eval ~(mock-user ,nick ,pattern)))))
     (if result
@@ -224,15 +210,15 @@ message."
       (append "No matching message found for " nick "."))))
 
 (defun sed-output (pattern replacement mode guy subject)
-  (let ((result (sed pattern replacement mode (nth subject 2)))
+  (let ((result (sed pattern replacement mode (line-body subject)))
 	(prefix nil)
-	(target (nth subject 1)))
+	(target (line-nick subject)))
     (setq prefix
 	  (if (string= guy target)
 	      (append guy " meant to say: ")
 	    (append guy " thinks " target " meant to say: ")))
     (append prefix
-	    (if (is-action subject) (append "* " target " ") "")
+	    (if (line-action subject) (append "* " target " ") "")
 	    result)))
 
 (defun parse-sed (string)
@@ -282,8 +268,8 @@ s(\p{P}|\p{S})(.*\2.*)\2(\S*)\s*$"
   "If LINE represents a sed command then perform the intended \
 substitution on the first line in the channel history that matches \
 the pattern described by it."
-  (let ((nick (get-nick line))
-	(arguments (parse-sed (get-body line)))
+  (let ((nick (line-nick line))
+	(arguments (parse-sed (line-body line)))
 	(target (nth arguments 0))
 	(pattern (nth arguments 1))
 	(replacement (nth arguments 2))
@@ -301,29 +287,32 @@ the pattern described by it."
 
 (defun log-line (line)
   (if should-log
-      (setq log (cons line log)))
+      (progn
+	(ring-push log line)
+	(if log-directory (log-store line))))
   (setq should-log t)
 
   ;; Ignore `should-log' for this one.
-  (setq raw-log (cons line raw-log))
+  (ring-push raw-log line)
   nil)
 
 (defun format-line (line)
   "Produce a string representation of LINE in a log-like format."
-  (append (get-date line)
-	  (if (is-action line)
-	      (append " * " (get-nick line) " ")
-	    (append " <" (get-nick line) "> "))
-	  (get-body line)))
+  (append (line-time line)
+	  (if (line-action line)
+	      (append " * " (line-nick line) " ")
+	    (append " <" (line-nick line) "> "))
+	  (line-body line)))
 
 (defun ping () '"pong")
 
 (defun history ()
-  (let ((node (reverse raw-log))
+  (let ((idx (length raw-log))
 	(output ""))
-    (while node
-      (setq output (append output (format-line (car node)) "\n"))
-      (setq node (cdr node)))
+    ;; Walk from the oldest line to the newest.
+    (while (> 0 idx)
+      (setq idx (- idx 1))
+      (setq output (append output (format-line (ring-ref raw-log idx)) "\n")))
     output))
 
 (defun number-to-string (x)
@@ -445,7 +434,7 @@ PATTERN allow you to narrow down your mpanage to a particular \
 message."
   (let ((result (if (not nick)
 		    ;; If there's no nick then do the last line.
-		    (mpanize (nth (car log) 2))
+		    (mpanize (line-body (ring-ref log 0)))
 		  ;; Otherwise actually mpan the user.
 		  (eval ~(mpan-user ,nick ,pattern)))))
     (if result
@@ -5,6 +5,8 @@
 #include <stdlib.h>
 #include <time.h>
 #include <pthread.h>
+#include <errno.h>
+#include <sys/stat.h>
 
 #include <kdg/kdgu.h>
 
@@ -20,6 +22,10 @@
 #include "irc.h"
 #include "birch.h"
 #include "server.h"
+#include "store.h"
+#include "trigram.h"
+#include "image.h"
+#include "lisp/regex.h"
 
 /*
  * Evaluates all arguments beyond the first argument in `v` as if they
@@ -218,7 +224,9 @@ builtin_join(struct env *env, value v)
 			     cons(env, server,
 			          cons(env, channel,
 			               NIL)));
+		budget_start(birch_get_env(env->birch, serv, chan));
 		value res = eval(env, call);
+		budget_end(env);
 		if (type(res) == VAL_ERROR) {
 			printf("error in join-hook: %s\nin: %s\n",
 			       tostring(string(res)),
@@ -243,6 +251,754 @@ builtin_current_channel(struct env *env, value v)
 	return quickstring(env, env->channel);
 }
 
+/*
+ * Returns an association list of the number of heap objects held by
+ * the current channel and the most it has held at once.
+ */
+
+value
+builtin_heap_usage(struct env *env, value v)
+{
+	if (type(v) != VAL_NIL)
+		return error(env, "`heap-usage' takes no arguments");
+
+	struct env *e = birch_get_env(env->birch,
+	                              env->server,
+	                              env->channel);
+
+	value usage = mkint(e->usage);
+	value peak = mkint(e->peak);
+
+	return acons(env, make_symbol(env, "usage"), usage,
+	             acons(env, make_symbol(env, "peak"), peak, NIL));
+}
+
+/*
+ * Returns the line object that is the only argument in `v`.
+ */
+
+static value
+line_arg(struct env *env, value v, const char *name)
+{
+	if (integer(list_length(env, v)) != 1)
+		return error(env, "builtin `%s' takes one argument", name);
+
+	v = eval(env, car(v));
+	if (type(v) == VAL_ERROR) return v;
+
+	if (type(v) != VAL_LINE)
+		return error(env, "builtin `%s' takes a line", name);
+
+	return v;
+}
+
+static kdgu *
+line_body(struct line *l)
+{
+	size_t len;
+	const char *s = line_text(l, &len);
+	return kdgu_new(KDGU_FMT_UTF8, s, len);
+}
+
+/*
+ * The line accessors make their string the first time they're called
+ * and keep it in the line object after that.
+ */
+
+#define LINE_ACCESSOR(X,Y)	  \
+	value \
+	builtin_line_ ## X(struct env *env, value v) \
+	{ \
+		v = line_arg(env, v, "line-" #X); \
+		if (type(v) == VAL_ERROR) return v; \
+		if (type(line(v).X) == VAL_NIL) { \
+			struct line *l = line(v).l; \
+			value str = gc_alloc(env, VAL_STRING); \
+			string(str) = Y; \
+			line(v).X = str; \
+		} \
+		return line(v).X; \
+	}
+
+LINE_ACCESSOR(nick, kdgu_news(l->nick ? l->nick : ""))
+LINE_ACCESSOR(body, line_body(l))
+LINE_ACCESSOR(time, kdgu_news(l->date))
+LINE_ACCESSOR(host, kdgu_news(l->host ? l->host : ""))
+LINE_ACCESSOR(channel, kdgu_news(l->num_middle ? l->middle[0] : ""))
+
+/*
+ * Returns t if the line is a CTCP ACTION (a `/me`).
+ */
+
+value
+builtin_line_action(struct env *env, value v)
+{
+	v = line_arg(env, v, "line-action");
+	if (type(v) == VAL_ERROR) return v;
+
+	const char *s = line(v).l->trailing;
+	return s && !strncmp(s, "\1ACTION", 7) ? TRUE : NIL;
+}
+
+/*
+ * Returns the trailing parameter (the message) of the raw IRC line
+ * `s` of `len` bytes and sets `n` to its length.
+ */
+
+static const char *
+raw_trailing(const char *s, size_t len, size_t *n)
+{
+	for (size_t i = 1; i + 1 < len; i++) {
+		if (s[i] == ' ' && s[i + 1] == ':') {
+			*n = len - i - 2;
+			return s + i + 2;
+		}
+	}
+
+	*n = 0;
+	return s;
+}
+
+/*
+ * The trigram index of the lines a history held when it was opened.
+ * It's built on a thread of its own so that opening the history
+ * doesn't wait for it, and merged into the channel's index of newer
+ * lines once it's complete; see `channel_index`.
+ */
+
+struct backfill {
+	pthread_mutex_t lock;
+	struct store *store;
+	size_t end;                     /* The first line not covered. */
+	struct trigram *index;          /* Set once it's complete.     */
+};
+
+static void *
+backfill_main(void *data)
+{
+	struct backfill *b = data;
+	struct store_page page = { 0 };
+	struct trigram *t = trigram_new();
+
+	for (size_t i = store_first(b->store); i < b->end; i++) {
+		size_t len, n;
+		const char *text = store_read_page(b->store, i, &len, &page);
+		if (!text) continue;
+		text = raw_trailing(text, len, &n);
+		trigram_add(t, i, text, n);
+	}
+
+	free(page.data);
+
+	pthread_mutex_lock(&b->lock);
+	b->index = t;
+	pthread_mutex_unlock(&b->lock);
+
+	return NULL;
+}
+
+/*
+ * Starts indexing the on-disk history of the channel environment `e`.
+ * Lines logged from now on are indexed as they are logged.
+ */
+
+static void
+index_store(struct env *e)
+{
+	struct backfill *b = calloc(1, sizeof *b);
+	pthread_mutex_init(&b->lock, NULL);
+	b->store = e->store;
+	b->end = store_count(e->store);
+
+	e->index = trigram_new();
+	e->index_first = store_first(e->store);
+	e->index_end = b->end;
+	e->backfill = b;
+
+	pthread_t thread;
+	pthread_create(&thread, NULL, backfill_main, b);
+	pthread_detach(thread);
+}
+
+/*
+ * Returns the trigram index of the channel environment `e` if it
+ * covers all of the history, after adding the lines the writer has
+ * committed since and dropping the lines the store no longer has.
+ * Returns NULL if the channel isn't indexed or the older lines are
+ * still being indexed.
+ *
+ * Lines are indexed by their number in the store, and only once they
+ * are in it; a line that the writer failed to write never takes up a
+ * number.
+ */
+
+static struct trigram *
+channel_index(struct env *e)
+{
+	if (!e->index) return NULL;
+
+	size_t count = store_count(e->store);
+	size_t i = e->index_end;
+	if (i < store_first(e->store)) i = store_first(e->store);
+
+	for (; i < count; i++) {
+		size_t len, n;
+		const char *text = store_read(e->store, i, &len);
+		if (!text) continue;
+		text = raw_trailing(text, len, &n);
+		trigram_add(e->index, i, text, n);
+	}
+
+	e->index_end = count;
+
+	if (e->backfill) {
+		struct backfill *b = e->backfill;
+
+		pthread_mutex_lock(&b->lock);
+		struct trigram *t = b->index;
+		pthread_mutex_unlock(&b->lock);
+
+		if (!t) return NULL;
+
+		trigram_merge(t, e->index);
+		e->index = t;
+		e->backfill = NULL;
+		pthread_mutex_destroy(&b->lock);
+		free(b);
+	}
+
+	size_t first = store_first(e->store);
+
+	if (first > e->index_first) {
+		trigram_prune(e->index, first);
+		e->index_first = first;
+	}
+
+	return e->index;
+}
+
+/*
+ * Returns the value of the integer variable `name`, or zero if it is
+ * unbound or not an integer.
+ */
+
+static long long
+int_variable(struct env *env, const char *name)
+{
+	value v = find(env, make_symbol(env, name));
+	if (type(v) == VAL_NIL || type(cdr(v)) != VAL_INT) return 0;
+	return integer(cdr(v));
+}
+
+/*
+ * Sets `s` to the on-disk history of the current channel, opening it
+ * under the directory named by `log-directory` first if need be. The
+ * history is indexed as it is opened if `log-index` is set, and its
+ * segments are rotated and retained as `log-segment-size` (in
+ * kilobytes), `log-retention-days` and `log-retention-size` (in
+ * megabytes) say. Opening a history also applies `log-durability`
+ * (none, periodic or group) and `log-commit-interval` (in
+ * milliseconds) to the writer shared by all of them.
+ */
+
+static value
+channel_store(struct env *env, const char *name, struct store **s)
+{
+	struct env *e = birch_get_env(env->birch,
+	                              env->server,
+	                              env->channel);
+
+	if (e->store) {
+		*s = e->store;
+		return NIL;
+	}
+
+	if (!strcmp(e->channel, "global"))
+		return error(env, "builtin `%s' must be used in a"
+		             " channel", name);
+
+	value dir = find(env, make_symbol(env, "log-directory"));
+
+	if (type(dir) == VAL_NIL || type(cdr(dir)) != VAL_STRING)
+		return error(env, "builtin `%s' requires"
+		             " `log-directory' to be a string", name);
+
+	char *base = tostring(string(cdr(dir)));
+	char *path = malloc(strlen(base)
+	                    + strlen(e->server)
+	                    + strlen(e->channel) + 3);
+
+	sprintf(path, "%s/%s", base, e->server);
+	mkdir(base, 0755);
+	mkdir(path, 0755);
+
+	/* Channel names may contain slashes. */
+	char *chan = path + strlen(path) + 1;
+	sprintf(path + strlen(path), "/%s", e->channel);
+	for (char *c = chan; *c; c++) if (*c == '/') *c = '_';
+
+	e->store = store_open(path);
+	free(base);
+
+	if (!e->store) {
+		value err = error(env, "couldn't open %s: %s",
+		                  path, strerror(errno));
+		free(path);
+		return err;
+	}
+
+	free(path);
+	*s = e->store;
+
+	store_configure(e->store,
+	                int_variable(env, "log-segment-size") << 10,
+	                int_variable(env, "log-retention-days") * 86400,
+	                int_variable(env, "log-retention-size") << 20);
+
+	value sync = find(env, make_symbol(env, "log-durability"));
+	enum store_sync mode = STORE_SYNC_PERIODIC;
+
+	if (type(sync) != VAL_NIL && type(cdr(sync)) == VAL_SYMBOL) {
+		char *name = tostring(string(cdr(sync)));
+		if (!strcmp(name, "none")) mode = STORE_SYNC_NONE;
+		if (!strcmp(name, "group")) mode = STORE_SYNC_GROUP;
+		free(name);
+	}
+
+	store_durability(mode, int_variable(env, "log-commit-interval"));
+
+	value index = find(env, make_symbol(env, "log-index"));
+	if (type(index) != VAL_NIL && type(cdr(index)) != VAL_NIL)
+		index_store(e);
+
+	return NIL;
+}
+
+/*
+ * Parses the `i`th newest line in the store `s`, or returns NULL if
+ * there is no such line.
+ */
+
+static struct line *
+store_line(struct store *s, size_t i)
+{
+	size_t n = store_count(s), len;
+	if (i >= n) return NULL;
+
+	const char *text = store_read(s, n - 1 - i, &len);
+	if (!text) return NULL;
+
+	char *buf = malloc(len + 1);
+	memcpy(buf, text, len);
+	buf[len] = 0;
+
+	struct line *l = line_new(buf, store_entry(s, n - 1 - i)->time);
+	free(buf);
+
+	return l;
+}
+
+/*
+ * (log-store line)
+ *
+ * Appends a line to the on-disk history of the current channel.
+ */
+
+value
+builtin_log_store(struct env *env, value v)
+{
+	v = line_arg(env, v, "log-store");
+	if (type(v) == VAL_ERROR) return v;
+
+	struct store *s;
+	value err = channel_store(env, "log-store", &s);
+	if (type(err) == VAL_ERROR) return err;
+
+	struct line *l = line(v).l;
+
+	if (store_append(s, l->time, l->text, strlen(l->text)))
+		return error(env, "couldn't log a line: %s",
+		             strerror(errno));
+
+	/* Keep the index up with the writer a little at a time. */
+	channel_index(birch_get_env(env->birch, env->server, env->channel));
+
+	return TRUE;
+}
+
+/*
+ * (log-count)
+ *
+ * Returns the number of lines in the on-disk history of the current
+ * channel.
+ */
+
+value
+builtin_log_count(struct env *env, value v)
+{
+	if (type(v) != VAL_NIL)
+		return error(env, "`log-count' takes no arguments");
+
+	struct store *s;
+	value err = channel_store(env, "log-count", &s);
+	if (type(err) == VAL_ERROR) return err;
+
+	value ret = mkint(store_count(s));
+	return ret;
+}
+
+/*
+ * (log-ref n)
+ *
+ * Returns the `n`th newest line in the on-disk history of the
+ * current channel, or nil. The line is read from disk when it is
+ * asked for; nothing else in the history is loaded.
+ */
+
+value
+builtin_log_ref(struct env *env, value v)
+{
+	if (integer(list_length(env, v)) != 1)
+		return error(env, "builtin `log-ref' takes one argument");
+
+	v = eval(env, car(v));
+	if (type(v) == VAL_ERROR) return v;
+	if (type(v) != VAL_INT || integer(v) < 0)
+		return error(env, "builtin `log-ref' takes a"
+		             " non-negative integer");
+
+	struct store *s;
+	value err = channel_store(env, "log-ref", &s);
+	if (type(err) == VAL_ERROR) return err;
+
+	struct line *l = store_line(s, integer(v));
+	return l ? make_line(env, l) : NIL;
+}
+
+/*
+ * (log-seek time)
+ *
+ * Returns the position (as used by `log-ref') of the newest line
+ * logged at or before `time`, in seconds since the epoch, or nil if
+ * there is none.
+ */
+
+value
+builtin_log_seek(struct env *env, value v)
+{
+	if (integer(list_length(env, v)) != 1)
+		return error(env, "builtin `log-seek' takes one argument");
+
+	v = eval(env, car(v));
+	if (type(v) == VAL_ERROR) return v;
+	if (type(v) != VAL_INT)
+		return error(env, "builtin `log-seek' takes an integer");
+
+	struct store *s;
+	value err = channel_store(env, "log-seek", &s);
+	if (type(err) == VAL_ERROR) return err;
+
+	size_t n = store_count(s);
+	size_t i = store_seek(s, (int64_t)integer(v) + 1);
+	if (!i) return NIL;
+
+	value ret = mkint(n - i);
+	return ret;
+}
+
+/*
+ * (log-search nick pattern &optional mode limit start)
+ *
+ * Does what `history-search' does over the on-disk history of the
+ * current channel, starting from the `start`th newest line. Records
+ * are checked for the literal part of the pattern before they are
+ * parsed. If the channel is indexed only the records that have all
+ * the trigrams of the literal are looked at.
+ */
+
+value
+builtin_log_search(struct env *env, value v)
+{
+	int len = integer(list_length(env, v));
+	if (len < 2 || len > 5)
+		return error(env, "builtin `log-search' takes"
+		             " two to five arguments");
+
+	v = eval_list(env, v);
+	if (type(v) == VAL_ERROR) return v;
+
+	value limit = car(cdr(cdr(cdr(v))));
+	value start = car(cdr(cdr(cdr(cdr(v)))));
+
+	if ((type(limit) && type(limit) != VAL_INT)
+	    || (type(start) && type(start) != VAL_INT))
+		return error(env, "the limit and start of `log-search'"
+		             " must be integers");
+
+	struct store *s;
+	value err = channel_store(env, "log-search", &s);
+	if (type(err) == VAL_ERROR) return err;
+
+	struct matcher m;
+	err = matcher_init(env, &m, "log-search",
+	                   car(v),
+	                   car(cdr(v)),
+	                   car(cdr(cdr(v))));
+	if (type(err) == VAL_ERROR) return err;
+
+	size_t n = store_count(s);
+	size_t i = type(start) && integer(start) > 0 ? integer(start) : 0;
+	int max = type(limit) ? integer(limit) : -1;
+	value ret = NIL, *tail = &ret;
+
+	struct env *e = birch_get_env(env->birch,
+	                              env->server,
+	                              env->channel);
+	struct trigram *t = channel_index(e);
+	size_t num = 0;
+	uint32_t *cand = t && m.literal
+		? trigram_query(t, m.literal, &num)
+		: NULL;
+
+	/* Walk the candidates newest-first instead of every record. */
+	for (size_t c = num; cand && c-- && max;) {
+		if (cand[c] + i >= n) continue;
+		if (cand[c] < store_first(s)) break;
+
+		struct line *l = store_line(s, n - 1 - cand[c]);
+		if (!l) continue;
+
+		if (!matcher_match(&m, l)) {
+			line_free(l);
+			continue;
+		}
+
+		value err = budget_check(env);
+		if (type(err) == VAL_ERROR) {
+			line_free(l);
+			free(cand);
+			matcher_free(&m);
+			return err;
+		}
+
+		*tail = cons(env, make_line(env, l), NIL);
+		tail = &cdr(*tail);
+		max--;
+	}
+
+	/* Dropped records are always the oldest ones. */
+	size_t stop = cand ? 0 : n - store_first(s);
+	free(cand);
+
+	for (; i < stop && max; i++) {
+		size_t len;
+		const char *text = store_read(s, n - 1 - i, &len);
+		if (!text || !matcher_maybe(&m, text, len)) continue;
+
+		struct line *l = store_line(s, i);
+		if (!l) continue;
+
+		if (!matcher_match(&m, l)) {
+			line_free(l);
+			continue;
+		}
+
+		value err = budget_check(env);
+		if (type(err) == VAL_ERROR) {
+			line_free(l);
+			matcher_free(&m);
+			return err;
+		}
+
+		*tail = cons(env, make_line(env, l), NIL);
+		tail = &cdr(*tail);
+		max--;
+	}
+
+	matcher_free(&m);
+
+	return ret;
+}
+
+/*
+ * (log-index-statistics)
+ *
+ * Returns an association list describing the trigram index of the
+ * current channel: the number of lines indexed, distinct trigrams and
+ * postings, its size in bytes and the average time in nanoseconds it
+ * took to index a line. While the lines the history held when it was
+ * opened are still being indexed, only newer lines are counted.
+ * Returns nil if the channel isn't indexed.
+ */
+
+value
+builtin_log_index_statistics(struct env *env, value v)
+{
+	if (type(v) != VAL_NIL)
+		return error(env, "`log-index-statistics'"
+		             " takes no arguments");
+
+	struct store *s;
+	value err = channel_store(env, "log-index-statistics", &s);
+	if (type(err) == VAL_ERROR) return err;
+
+	struct env *e = birch_get_env(env->birch,
+	                              env->server,
+	                              env->channel);
+	if (!e->index) return NIL;
+
+	/* Until the older lines are indexed only newer ones count. */
+	struct trigram *t = channel_index(e);
+	if (!t) t = e->index;
+
+	size_t trigrams, postings, bytes, updates;
+	long long ns;
+	trigram_statistics(t, &trigrams, &postings,
+	                   &bytes, &ns, &updates);
+
+	value lines = mkint(updates);
+	value tri = mkint(trigrams);
+	value post = mkint(postings);
+	value size = mkint(bytes);
+	value cost = mkint(updates ? ns / updates : 0);
+
+	value ret = NIL;
+	ret = acons(env, make_symbol(env, "update-ns"), cost, ret);
+	ret = acons(env, make_symbol(env, "bytes"), size, ret);
+	ret = acons(env, make_symbol(env, "postings"), post, ret);
+	ret = acons(env, make_symbol(env, "trigrams"), tri, ret);
+	ret = acons(env, make_symbol(env, "lines"), lines, ret);
+
+	return ret;
+}
+
+/*
+ * (log-writer-statistics)
+ *
+ * Returns an association list describing the writer that appends to
+ * the on-disk histories: the number of lines waiting to be written,
+ * how many milliseconds the oldest line of its last batch waited and
+ * the longest any line has waited, the bytes written in all and per
+ * second, and the number of times it has synced a history to disk.
+ */
+
+value
+builtin_log_writer_statistics(struct env *env, value v)
+{
+	if (type(v) != VAL_NIL)
+		return error(env, "`log-writer-statistics'"
+		             " takes no arguments");
+
+	size_t queued;
+	long long lag, max_lag;
+	uint64_t bytes, rate, syncs;
+	store_writer_statistics(&queued, &lag, &max_lag,
+	                        &bytes, &rate, &syncs);
+
+	value pending = mkint(queued);
+	value last = mkint(lag / 1000000);
+	value worst = mkint(max_lag / 1000000);
+	value total = mkint(bytes);
+	value speed = mkint(rate);
+	value synced = mkint(syncs);
+
+	value ret = NIL;
+	ret = acons(env, make_symbol(env, "syncs"), synced, ret);
+	ret = acons(env, make_symbol(env, "bytes-per-second"), speed, ret);
+	ret = acons(env, make_symbol(env, "bytes"), total, ret);
+	ret = acons(env, make_symbol(env, "max-lag-ms"), worst, ret);
+	ret = acons(env, make_symbol(env, "lag-ms"), last, ret);
+	ret = acons(env, make_symbol(env, "pending"), pending, ret);
+
+	return ret;
+}
+
+/*
+ * (dump-image [path])
+ *
+ * Writes an image of the heap, including the variables of every
+ * channel, to `path` or BIRCH_IMAGE. The bot starts from BIRCH_IMAGE
+ * instead of its configuration the next time if the configuration
+ * hasn't changed since.
+ */
+
+value
+builtin_dump_image(struct env *env, value v)
+{
+	if (env->birch->env->protect)
+		return error(env, "`dump-image' can't be used from"
+		             " `birch-eval'");
+
+	char *p;
+
+	if (type(v) == VAL_CELL) {
+		if (type(cdr(v)) != VAL_NIL)
+			return error(env, "builtin `dump-image' takes at"
+			             " most one argument");
+
+		value path = eval(env, car(v));
+		if (type(path) == VAL_ERROR) return path;
+
+		if (type(path) != VAL_STRING)
+			return error(env, "the path given to `dump-image'"
+			             " must be a string");
+
+		p = tostring(string(path));
+	} else {
+		p = strdup(BIRCH_IMAGE);
+	}
+
+	if (image_dump(env->birch, p)) {
+		value err = error(env, "couldn't write an image to %s: %s",
+		                  p, strerror(errno));
+		free(p);
+		return err;
+	}
+
+	free(p);
+	return TRUE;
+}
+
+/*
+ * (reload [path])
+ *
+ * Evaluates the configuration in `path` or the file named by
+ * `config-file` again, keeping the connections and channel
+ * environments. If anything goes wrong the global variables are left
+ * as they were and the error is returned.
+ */
+
+value
+builtin_reload(struct env *env, value v)
+{
+	if (env->birch->env->protect)
+		return error(env, "`reload' can't be used from"
+		             " `birch-eval'");
+
+	value path = NIL;
+
+	if (type(v) == VAL_CELL) {
+		if (type(cdr(v)) != VAL_NIL)
+			return error(env, "builtin `reload' takes at"
+			             " most one argument");
+		path = eval(env, car(v));
+		if (type(path) == VAL_ERROR) return path;
+	} else {
+		value bind = find(env, make_symbol(env, "config-file"));
+		if (type(bind) != VAL_NIL) path = cdr(bind);
+	}
+
+	if (type(path) != VAL_STRING)
+		return error(env, "builtin `reload' requires a path"
+		             " or `config-file' to be a string");
+
+	char *p = tostring(string(path));
+	value ret = birch_reload(env->birch, p);
+	free(p);
+
+	return ret;
+}
+
 value
 builtin_birch_eval(struct env *env, value v)
 {
@@ -5,3 +5,19 @@ value builtin_stdout(struct env *env, value v);
 value builtin_current_server(struct env *env, value v);
 value builtin_current_channel(struct env *env, value v);
 value builtin_birch_eval(struct env *env, value v);
+value builtin_heap_usage(struct env *env, value v);
+value builtin_line_nick(struct env *env, value v);
+value builtin_line_body(struct env *env, value v);
+value builtin_line_time(struct env *env, value v);
+value builtin_line_host(struct env *env, value v);
+value builtin_line_channel(struct env *env, value v);
+value builtin_line_action(struct env *env, value v);
+value builtin_log_store(struct env *env, value v);
+value builtin_log_count(struct env *env, value v);
+value builtin_log_ref(struct env *env, value v);
+value builtin_log_seek(struct env *env, value v);
+value builtin_log_search(struct env *env, value v);
+value builtin_log_index_statistics(struct env *env, value v);
+value builtin_log_writer_statistics(struct env *env, value v);
+value builtin_dump_image(struct env *env, value v);
+value builtin_reload(struct env *env, value v);
@@ -0,0 +1,623 @@
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <kdg/kdgu.h>
+
+#include "lisp/lisp.h"
+#include "lisp/gc.h"
+#include "lisp/table.h"
+
+#include "list.h"
+#include "irc.h"
+#include "birch.h"
+#include "image.h"
+
+#define IMAGE_VERSION 1
+
+/*
+ * An image is laid out as
+ *
+ *     header bitmap objects... channels... data
+ *
+ * where the bitmap is the allocation bitmap of the heap up to the last
+ * object, and objects and channels refer to their strings and arrays
+ * by their offset into the data.
+ */
+
+struct image_header {
+	char magic[4];
+	uint32_t version;
+
+	/* The executable that wrote the image. */
+	uint64_t exe_size;
+	int64_t exe_mtime;
+
+	uint32_t num_obj, num_channel;
+	int32_t vars;           /* The global variables.              */
+	uint32_t reserved;
+	uint64_t size;          /* The size of the data.              */
+};
+
+/*
+ * One object. The meaning of `v` depends on the type; `off` and `len`
+ * give its string or array in the data, and `num` holds integers,
+ * times and builtins.
+ */
+
+struct image_object {
+	uint32_t type;
+	int32_t v[10];
+	uint32_t len;
+	uint64_t off;
+	int64_t num;
+};
+
+struct image_channel {
+	int32_t obj;
+	uint32_t server, channel;
+	uint32_t reserved;
+	uint64_t off;
+};
+
+struct buffer {
+	char *data;
+	size_t len, cap;
+};
+
+static uint64_t
+put(struct buffer *b, const void *p, size_t len)
+{
+	if (b->len + len > b->cap) {
+		b->cap = (b->len + len) * 2 + 4096;
+		b->data = realloc(b->data, b->cap);
+	}
+
+	memcpy(b->data + b->len, p, len);
+	b->len += len;
+
+	return b->len - len;
+}
+
+static int
+executable(uint64_t *size, int64_t *mtime)
+{
+	struct stat st;
+	if (stat("/proc/self/exe", &st)) return -1;
+	*size = st.st_size;
+	*mtime = st.st_mtime;
+	return 0;
+}
+
+#define allocated(G, X) ((G)->bmp[(X) / 64] & (1ULL << ((X) % 64)))
+
+/*
+ * Builtins are stored relative to a function of ours, which doesn't
+ * change within one executable wherever it is loaded.
+ */
+
+static int64_t
+relocate(builtin *f)
+{
+	return (intptr_t)f - (intptr_t)image_dump;
+}
+
+static builtin *
+unrelocate(int64_t off)
+{
+	return (builtin *)((intptr_t)image_dump + off);
+}
+
+/* Environments are referred to by the objects that own them. */
+
+static int32_t
+env_ref(struct birch *b, struct env *e)
+{
+	if (!e) return -1;
+	if (e == b->env) return NIL;
+	return e->obj;
+}
+
+static struct env *
+env_at(struct birch *b, int32_t ref)
+{
+	struct env *env = b->env;
+	if (ref < 0) return NULL;
+	if (ref == NIL) return b->env;
+	return frame(ref);
+}
+
+static void
+put_entry(struct env *env, value key, value val, void *data)
+{
+	(void)env;
+	int32_t pair[2] = { key, val };
+	put(data, pair, sizeof pair);
+}
+
+static void
+dump_object(struct birch *b,
+            struct buffer *data,
+            struct image_object *o,
+            value v)
+{
+	struct env *env = b->env;
+	o->type = type(v);
+
+	switch (type(v)) {
+	case VAL_INT:
+		o->num = integer(v);
+		break;
+	case VAL_STRING:
+	case VAL_SYMBOL:
+	case VAL_ERROR:
+		if (!string(v)) break;
+		o->v[0] = string(v)->fmt;
+		o->len = string(v)->len;
+		o->off = put(data, string(v)->s, string(v)->len);
+		break;
+	case VAL_CELL:
+		o->v[0] = car(v), o->v[1] = cdr(v);
+		o->v[2] = macro(v), o->v[3] = expansion(v);
+		break;
+	case VAL_COMMA:
+	case VAL_COMMAT:
+	case VAL_KEYWORD:
+	case VAL_KEYWORDPARAM:
+		o->v[0] = keyword(v);
+		break;
+	case VAL_VECTOR:
+		o->len = vector(v).len;
+		o->off = put(data, vector(v).elem,
+		             vector(v).len * sizeof (value));
+		break;
+	case VAL_RING:
+		o->v[0] = ring(v).cap;
+		o->v[1] = ring(v).len;
+		o->v[2] = ring(v).head;
+		o->off = put(data, ring(v).elem,
+		             ring(v).cap * sizeof (value));
+		break;
+	case VAL_HASH:
+		o->len = table_count(table(v));
+		o->off = data->len;
+		table_each(env, table(v), put_entry, data);
+		break;
+	case VAL_LINE:
+		o->v[0] = line(v).nick, o->v[1] = line(v).body;
+		o->v[2] = line(v).time, o->v[3] = line(v).host;
+		o->v[4] = line(v).channel;
+		o->num = line(v).l->time;
+		o->len = strlen(line(v).l->text);
+		o->off = put(data, line(v).l->text, o->len);
+		break;
+	case VAL_BUILTIN:
+		o->num = relocate(builtin(v));
+		break;
+	case VAL_FUNCTION:
+	case VAL_MACRO:
+		o->v[0] = param(v), o->v[1] = body(v);
+		o->v[2] = optional(v), o->v[3] = key(v);
+		o->v[4] = rest(v), o->v[5] = docstring(v);
+		o->v[6] = env_ref(b, env(v));
+		o->v[7] = function(v).num_required;
+		o->v[8] = function(v).num_optional;
+		o->v[9] = function(v).num_key;
+		if (!name(v)) break;
+		o->num = 1;
+		o->len = name(v)->len;
+		o->off = put(data, name(v)->s, name(v)->len);
+		break;
+	case VAL_ENV:
+		o->v[0] = frame(v)->vars;
+		o->v[1] = env_ref(b, frame(v)->up);
+		break;
+	default:;
+	}
+}
+
+/*
+ * Writes an image of the heap of `b` to `path`. The image replaces
+ * `path` only once it is complete. Returns zero on success.
+ */
+
+int
+image_dump(struct birch *b, const char *path)
+{
+	struct env *env = b->env;
+	struct gc *gc = env->gc;
+	struct image_header h = { "BIMG", IMAGE_VERSION };
+
+	if (executable(&h.exe_size, &h.exe_mtime)) return -1;
+
+	for (uint32_t i = 0; i < GC_MAX_OBJECT; i++)
+		if (allocated(gc, i)) h.num_obj = i + 1;
+
+	struct image_object *obj = calloc(h.num_obj + 1, sizeof *obj);
+	struct buffer data = { 0 };
+
+	for (uint32_t i = 0; i < h.num_obj; i++)
+		if (allocated(gc, i))
+			dump_object(b, &data, &obj[i], i);
+
+	for (struct list *l = b->channel; l; l = l->next)
+		h.num_channel++;
+
+	struct image_channel *chan = calloc(h.num_channel + 1,
+	                                    sizeof *chan);
+	uint32_t n = 0;
+
+	for (struct list *l = b->channel; l; l = l->next, n++) {
+		struct env *e = l->data;
+		chan[n].obj = e->obj;
+		chan[n].server = strlen(e->server);
+		chan[n].channel = strlen(e->channel);
+		chan[n].off = put(&data, e->server, chan[n].server);
+		put(&data, e->channel, chan[n].channel);
+	}
+
+	h.vars = env->vars;
+	h.size = data.len;
+
+	char *tmp = malloc(strlen(path) + 5);
+	sprintf(tmp, "%s.tmp", path);
+
+	FILE *f = fopen(tmp, "wb");
+	size_t words = (h.num_obj + 63) / 64;
+	int err = !f
+		|| fwrite(&h, sizeof h, 1, f) != 1
+		|| fwrite(gc->bmp, sizeof *gc->bmp, words, f) != words
+		|| fwrite(obj, sizeof *obj, h.num_obj, f) != h.num_obj
+		|| fwrite(chan, sizeof *chan, h.num_channel, f)
+		   != h.num_channel
+		|| fwrite(data.data, 1, data.len, f) != data.len;
+
+	if (f && fclose(f)) err = 1;
+	if (!err && rename(tmp, path)) err = 1;
+	if (err) unlink(tmp);
+
+	free(tmp);
+	free(obj);
+	free(chan);
+	free(data.data);
+
+	return err ? -1 : 0;
+}
+
+static void
+load_object(struct birch *b,
+            const char *data,
+            const struct image_object *o,
+            value v)
+{
+	struct env *env = b->env;
+	type(v) = o->type;
+
+	switch (o->type) {
+	case VAL_INT:
+		integer(v) = o->num;
+		break;
+	case VAL_STRING:
+	case VAL_SYMBOL:
+	case VAL_ERROR:
+		string(v) = kdgu_new(o->v[0], data + o->off, o->len);
+		break;
+	case VAL_CELL:
+		car(v) = o->v[0], cdr(v) = o->v[1];
+		macro(v) = o->v[2], expansion(v) = o->v[3];
+		break;
+	case VAL_COMMA:
+	case VAL_COMMAT:
+	case VAL_KEYWORD:
+	case VAL_KEYWORDPARAM:
+		keyword(v) = o->v[0];
+		break;
+	case VAL_VECTOR:
+		vector(v).len = o->len;
+		vector(v).elem = calloc(o->len + 1, sizeof (value));
+		memcpy(vector(v).elem, data + o->off, o->len * sizeof (value));
+		break;
+	case VAL_RING:
+		ring(v).cap = o->v[0];
+		ring(v).len = o->v[1];
+		ring(v).head = o->v[2];
+		ring(v).elem = calloc(o->v[0] + 1, sizeof (value));
+		memcpy(ring(v).elem, data + o->off, o->v[0] * sizeof (value));
+		break;
+	case VAL_LINE: {
+		char *text = malloc(o->len + 1);
+		memcpy(text, data + o->off, o->len);
+		text[o->len] = 0;
+		line(v).l = line_new(text, o->num);
+		free(text);
+		line(v).nick = o->v[0], line(v).body = o->v[1];
+		line(v).time = o->v[2], line(v).host = o->v[3];
+		line(v).channel = o->v[4];
+	} break;
+	case VAL_BUILTIN:
+		builtin(v) = unrelocate(o->num);
+		break;
+	case VAL_FUNCTION:
+	case VAL_MACRO:
+		param(v) = o->v[0], body(v) = o->v[1];
+		optional(v) = o->v[2], key(v) = o->v[3];
+		rest(v) = o->v[4], docstring(v) = o->v[5];
+		function(v).num_required = o->v[7];
+		function(v).num_optional = o->v[8];
+		function(v).num_key = o->v[9];
+		if (o->num)
+			name(v) = kdgu_new(KDGU_FMT_UTF8,
+			                   data + o->off,
+			                   o->len);
+		break;
+	case VAL_ENV: {
+		/* Frames start out as copies of the global environment. */
+		struct env *e = malloc(sizeof *e);
+		memcpy(e, b->env, sizeof *e);
+		e->vars = o->v[0];
+		e->obj = v;
+		e->server = e->channel = NULL;
+		e->usage = e->peak = 0;
+		e->store = NULL;
+		e->index = NULL;
+		e->backfill = NULL;
+		frame(v) = e;
+	} break;
+	default:;
+	}
+}
+
+/*
+ * Images are checked before anything is loaded from them: every span
+ * must lie within the data and every reference must be to an object
+ * of the image.
+ */
+
+static bool
+valid_span(const struct image_header *h, uint64_t off, uint64_t len)
+{
+	return off <= h->size && len <= h->size - off;
+}
+
+static bool
+valid_value(const struct image_header *h, const uint64_t *bmp, int64_t v)
+{
+	return v >= 0 && v < h->num_obj
+		&& bmp[v / 64] & (1ULL << (v % 64));
+}
+
+static bool
+valid_values(const struct image_header *h,
+             const uint64_t *bmp,
+             const int32_t *v,
+             uint64_t n)
+{
+	for (uint64_t i = 0; i < n; i++)
+		if (!valid_value(h, bmp, v[i])) return false;
+	return true;
+}
+
+static bool
+valid_env(const struct image_header *h,
+          const uint64_t *bmp,
+          const struct image_object *obj,
+          int32_t ref)
+{
+	if (ref == -1 || ref == NIL) return true;
+	return valid_value(h, bmp, ref) && obj[ref].type == VAL_ENV;
+}
+
+static bool
+valid_object(const struct image_header *h,
+             const uint64_t *bmp,
+             const struct image_object *obj,
+             const char *data,
+             const struct image_object *o)
+{
+	switch (o->type) {
+	case VAL_STRING:
+	case VAL_SYMBOL:
+	case VAL_ERROR:
+		return valid_span(h, o->off, o->len);
+	case VAL_CELL:
+		/*
+		 * A call site keeps the macro it was expanded by after
+		 * that is collected, but only looks at the expansion
+		 * while the macro is still there.
+		 */
+		return valid_values(h, bmp, o->v, 2)
+			&& o->v[2] >= 0 && o->v[2] < GC_MAX_OBJECT
+			&& o->v[3] >= 0 && o->v[3] < GC_MAX_OBJECT
+			&& (!valid_value(h, bmp, o->v[2])
+			    || valid_value(h, bmp, o->v[3]));
+	case VAL_COMMA:
+	case VAL_COMMAT:
+	case VAL_KEYWORD:
+	case VAL_KEYWORDPARAM:
+		return valid_value(h, bmp, o->v[0]);
+	case VAL_VECTOR:
+		return valid_span(h, o->off, (uint64_t)o->len * sizeof (value))
+			&& valid_values(h, bmp, (const void *)(data + o->off),
+			                o->len);
+	case VAL_RING:
+		return o->v[0] >= 0 && o->v[0] <= GC_CHANNEL_MAX
+			&& o->v[1] >= 0 && o->v[1] <= o->v[0]
+			&& o->v[2] >= 0 && o->v[2] <= o->v[0]
+			&& valid_span(h, o->off,
+			              (uint64_t)o->v[0] * sizeof (value))
+			&& valid_values(h, bmp, (const void *)(data + o->off),
+			                o->v[0]);
+	case VAL_HASH:
+		return valid_span(h, o->off, (uint64_t)o->len * 8)
+			&& valid_values(h, bmp, (const void *)(data + o->off),
+			                (uint64_t)o->len * 2);
+	case VAL_LINE:
+		return valid_span(h, o->off, o->len)
+			&& valid_values(h, bmp, o->v, 5);
+	case VAL_FUNCTION:
+	case VAL_MACRO:
+		return valid_values(h, bmp, o->v, 6)
+			&& valid_env(h, bmp, obj, o->v[6])
+			&& o->v[7] >= 0 && o->v[8] >= 0 && o->v[9] >= 0
+			&& (!o->num || valid_span(h, o->off, o->len));
+	case VAL_ENV:
+		return valid_value(h, bmp, o->v[0])
+			&& valid_env(h, bmp, obj, o->v[1]);
+	default:
+		return o->type <= VAL_ERROR;
+	}
+}
+
+static bool
+valid_image(const struct image_header *h,
+            const uint64_t *bmp,
+            const struct image_object *obj,
+            const struct image_channel *chan,
+            const char *data)
+{
+	for (uint32_t i = 0; i < h->num_obj; i++)
+		if (valid_value(h, bmp, i)
+		    && !valid_object(h, bmp, obj, data, &obj[i]))
+			return false;
+
+	for (uint32_t i = 0; i < h->num_channel; i++)
+		if (!valid_value(h, bmp, chan[i].obj)
+		    || obj[chan[i].obj].type != VAL_ENV
+		    || !valid_span(h, chan[i].off,
+		                   (uint64_t)chan[i].server
+		                   + chan[i].channel))
+			return false;
+
+	return valid_value(h, bmp, h->vars);
+}
+
+/* A frame has the names of the environment it was made in. */
+
+static void
+inherit_names(struct env *e)
+{
+	if (e->server || !e->up) return;
+	inherit_names(e->up);
+	e->server = e->up->server;
+	e->channel = e->up->channel;
+}
+
+/*
+ * Loads the image at `path` into `b`, whose heap must hold nothing but
+ * the constants. Returns zero on success and leaves `b` untouched if
+ * the file isn't a sound image written by this executable.
+ */
+
+int
+image_load(struct birch *b, const char *path)
+{
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) return -1;
+
+	struct stat st;
+	if (fstat(fd, &st)
+	    || (size_t)st.st_size < sizeof (struct image_header)) {
+		close(fd);
+		return -1;
+	}
+
+	char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) return -1;
+
+	struct image_header h;
+	memcpy(&h, map, sizeof h);
+
+	uint64_t exe_size;
+	int64_t exe_mtime;
+	size_t words = (h.num_obj + 63) / 64;
+
+	if (memcmp(h.magic, "BIMG", 4)
+	    || h.version != IMAGE_VERSION
+	    || executable(&exe_size, &exe_mtime)
+	    || exe_size != h.exe_size
+	    || exe_mtime != h.exe_mtime
+	    || h.num_obj > GC_MAX_OBJECT
+	    || h.size > (uint64_t)st.st_size
+	    || h.num_channel > (uint64_t)st.st_size
+	    || sizeof h + words * sizeof (uint64_t)
+	       + h.num_obj * sizeof (struct image_object)
+	       + h.num_channel * sizeof (struct image_channel)
+	       + h.size != (uint64_t)st.st_size) {
+		munmap(map, st.st_size);
+		return -1;
+	}
+
+	const char *p = map + sizeof h;
+	const struct image_object *obj = (const void *)(p + words * 8);
+	const struct image_channel *chan =
+		(const void *)((const char *)obj + h.num_obj * sizeof *obj);
+	const char *data = (const char *)(chan + h.num_channel);
+
+	if (!valid_image(&h, (const void *)p, obj, chan, data)) {
+		munmap(map, st.st_size);
+		return -1;
+	}
+
+	struct env *env = b->env;
+	struct gc *gc = env->gc;
+	memcpy(gc->bmp, p, words * sizeof *gc->bmp);
+	gc_count(gc);
+
+	for (uint32_t i = 0; i < h.num_obj; i++)
+		if (allocated(gc, i))
+			load_object(b, data, &obj[i], i);
+
+	/*
+	 * Now that every object exists, link up the environments and
+	 * fill the tables, which hash their keys.
+	 */
+
+	for (uint32_t i = 0; i < h.num_obj; i++) {
+		if (!allocated(gc, i)) continue;
+
+		switch (type(i)) {
+		case VAL_ENV:
+			frame(i)->up = env_at(b, obj[i].v[1]);
+			break;
+		case VAL_FUNCTION:
+		case VAL_MACRO:
+			env(i) = env_at(b, obj[i].v[6]);
+			break;
+		case VAL_HASH: {
+			const int32_t *pair = (const void *)(data + obj[i].off);
+			table(i) = table_new();
+			for (uint32_t j = 0; j < obj[i].len; j++)
+				table_put(env, table(i),
+				          pair[2 * j], pair[2 * j + 1]);
+		} break;
+		default:;
+		}
+	}
+
+	for (uint32_t i = 0; i < h.num_channel; i++) {
+		struct env *e = frame(chan[i].obj);
+		const char *name = data + chan[i].off;
+		e->server = strndup(name, chan[i].server);
+		e->channel = strndup(name + chan[i].server,
+		                     chan[i].channel);
+		list_add(&b->channel, e);
+	}
+
+	for (uint32_t i = 0; i < h.num_obj; i++)
+		if (allocated(gc, i) && type(i) == VAL_ENV)
+			inherit_names(frame(i));
+
+	env->vars = h.vars;
+	munmap(map, st.st_size);
+
+	return 0;
+}
@@ -0,0 +1,12 @@
+/*
+ * Heap images. An image holds every object on the Lisp heap at its own
+ * index, so values need no translation; only the things objects point
+ * to outside the heap (strings, vectors, tables, environments and
+ * builtins) are rebuilt when it is loaded. It also records the global
+ * variables and the channel environments, so a bot started from an
+ * image skips reading its configuration and keeps its channel
+ * variables. An image only loads into the executable that wrote it.
+ */
+
+int image_dump(struct birch *b, const char *path);
+int image_load(struct birch *b, const char *path);
@@ -141,6 +141,7 @@ line_new(const char *a, time_t timer)
 		strcpy(l->host, a);
 	}
 
+	l->time = timer;
 	l->date = malloc(26);
 	strftime(l->date, 26,
 	         "%Y-%m-%d %H:%M:%S",
@@ -157,5 +158,28 @@ line_free(struct line *l)
 		free(l->middle[i]);
 	free(l->text), free(l->prefix);
 	free(l->middle), free(l->trailing);
+	free(l->nick), free(l->ident);
+	free(l->host), free(l->date);
 	free(l);
 }
+
+/*
+ * Returns the text of a line and sets `len` to its length. The text
+ * of a CTCP message excludes the delimiters and the CTCP command.
+ */
+
+const char *
+line_text(const struct line *l, size_t *len)
+{
+	const char *s = l->trailing ? l->trailing : "";
+	*len = strlen(s);
+
+	if (*s == 1) {
+		const char *body = strchr(s, ' ');
+		if (!body) return *len = 0, s;
+		*len -= ++body - s, s = body;
+		if (*len && s[*len - 1] == 1) (*len)--;
+	}
+
+	return s;
+}
@@ -49,9 +49,11 @@ struct line {
 
 	char *text, *prefix, **middle, *trailing;
 	char *nick, *ident, *host, *date;
+	time_t time;
 	unsigned num_middle;
 	int cmd, reply;
 };
 
 struct line *line_new(const char *s, time_t timer);
 void line_free(struct line *l);
+const char *line_text(const struct line *l, size_t *len);
@@ -21,6 +21,7 @@
 #include "birch.h"
 #include "server.h"
 #include "builtin.h"
+#include "trigger.h"
 
 void
 lisp_init(struct birch *b)
@@ -34,85 +35,243 @@ lisp_init(struct birch *b)
 	            "current-server", builtin_current_server);
 	add_builtin(b->env,
 	            "current-channel", builtin_current_channel);
+	add_builtin(b->env, "heap-usage", builtin_heap_usage);
+	add_builtin(b->env, "dump-image", builtin_dump_image);
+	add_builtin(b->env, "reload", builtin_reload);
+	add_builtin(b->env, "line-nick", builtin_line_nick);
+	add_builtin(b->env, "line-body", builtin_line_body);
+	add_builtin(b->env, "line-time", builtin_line_time);
+	add_builtin(b->env, "line-host", builtin_line_host);
+	add_builtin(b->env, "line-channel", builtin_line_channel);
+	add_builtin(b->env, "line-action", builtin_line_action);
+	add_builtin(b->env, "log-store", builtin_log_store);
+	add_builtin(b->env, "log-count", builtin_log_count);
+	add_builtin(b->env, "log-ref", builtin_log_ref);
+	add_builtin(b->env, "log-seek", builtin_log_seek);
+	add_builtin(b->env, "log-search", builtin_log_search);
+	add_builtin(b->env,
+	            "log-index-statistics",
+	            builtin_log_index_statistics);
+	add_builtin(b->env,
+	            "log-writer-statistics",
+	            builtin_log_writer_statistics);
+}
+
+/* The number of `msg-hook' lists whose guards are kept compiled. */
+#define HOOK_INDEX_MAX 16
+
+/*
+ * The guards of one `msg-hook' list, compiled into a trigger index,
+ * and the number of the guard of each entry.
+ */
+
+struct hook_index {
+	struct hook_index *next;
+	value hooks;
+	struct trigger *trigger;
+	int *guard;
+	int num;
+};
+
+/*
+ * Collects garbage. The global environment is marked first so that
+ * each channel environment (the server environments come before
+ * their channels in `b->channel`) is only credited with the objects
+ * that it alone keeps alive.
+ */
+
+static void
+collect(struct birch *b, struct env *env)
+{
+	gc_mark(env, b->env->vars);
+	for (struct hook_index *h = b->hook_index; h; h = h->next)
+		gc_mark(env, h->hooks);
+	parse_mark(env);
+
+	for (struct list *chan = b->channel; chan; chan = chan->next) {
+		struct env *e = chan->data;
+		e->usage = gc_mark(env, e->obj);
+		if (e->usage > e->peak) e->peak = e->usage;
+	}
+
+	/* It doesn't matter which environment is used here. */
+	gc_sweep(env);
+}
+
+#define HOOK_UNGUARDED -1
+#define HOOK_INVALID -2
+
+/*
+ * Returns the number of the guard of a `msg-hook' entry, after adding
+ * it to the trigger index. Guarded entries have one of the forms
+ * ((regex PATTERN [MODIFIERS]) . HOOK), ((prefix STRING) . HOOK) or
+ * ((nick NICK) . HOOK).
+ */
+
+static int
+add_guard(struct env *env, struct trigger *t, value entry)
+{
+	if (type(entry) != VAL_CELL
+	    || type(car(entry)) != VAL_CELL
+	    || type(car(car(entry))) != VAL_SYMBOL)
+		return HOOK_UNGUARDED;
+
+	kdgu *kind = string(car(car(entry)));
+	value args = cdr(car(entry));
+	enum trigger_kind k;
+	int opt = KTRE_UNANCHORED;
+
+	if (kdgu_cmp(kind, &KDGU("regex"), false, NULL))
+		k = TRIGGER_REGEX;
+	else if (kdgu_cmp(kind, &KDGU("prefix"), false, NULL))
+		k = TRIGGER_PREFIX;
+	else if (kdgu_cmp(kind, &KDGU("nick"), false, NULL))
+		k = TRIGGER_NICK;
+	else
+		return HOOK_UNGUARDED;
+
+	if (type(args) != VAL_CELL || type(car(args)) != VAL_STRING)
+		return HOOK_INVALID;
+
+	if (k == TRIGGER_REGEX && type(cdr(args)) == VAL_CELL) {
+		value mod = car(cdr(args));
+		if (type(mod) != VAL_STRING) return HOOK_INVALID;
+
+		for (unsigned i = 0; i < string(mod)->len; i++) {
+			switch (string(mod)->s[i]) {
+			case 'i': opt |= KTRE_INSENSITIVE; break;
+			default: return HOOK_INVALID;
+			}
+		}
+	}
+
+	int g = trigger_add(t, k, string(car(args)), opt);
+	return g < 0 ? HOOK_INVALID : g;
 }
 
-static value
-quickstring(struct env *env, const char *str)
+/*
+ * Returns the compiled guards of the hook list `hooks`, compiling them
+ * into one trigger index if need be. The most recently run lists are
+ * kept, most recent first, so channels with lists of their own don't
+ * recompile each other's guards. The indexes hold on to their lists
+ * (see `collect'), so a list with the same cell is the same list as
+ * long as it isn't modified in place.
+ */
+
+static struct hook_index *
+index_hooks(struct birch *b, struct env *env, value hooks)
 {
-	value v = gc_alloc(env, VAL_STRING);
-	string(v) = kdgu_news(str);
-	return v;
+	struct hook_index **p, *h;
+
+	for (p = &b->hook_index; (h = *p); p = &h->next) {
+		if (h->hooks != hooks) continue;
+		*p = h->next;
+		h->next = b->hook_index;
+		b->hook_index = h;
+		return h;
+	}
+
+	h = malloc(sizeof *h);
+	h->hooks = hooks;
+	h->trigger = trigger_new();
+	h->num = 0;
+
+	for (value i = hooks; type(i) == VAL_CELL; i = cdr(i))
+		h->num++;
+
+	h->guard = malloc((h->num + 1) * sizeof *h->guard);
+
+	int n = 0;
+
+	for (value i = hooks; type(i) == VAL_CELL; i = cdr(i), n++) {
+		h->guard[n] = add_guard(env, h->trigger, car(i));
+		if (h->guard[n] == HOOK_INVALID) {
+			puts("msg-hook error: invalid guard:");
+			puts(tostring(string(print_value(env, car(i)))));
+		}
+	}
+
+	trigger_build(h->trigger);
+
+	h->next = b->hook_index;
+	b->hook_index = h;
+
+	/* Drop the least recently run lists. */
+	n = 0;
+
+	for (p = &b->hook_index; *p; p = &(*p)->next) {
+		if (++n <= HOOK_INDEX_MAX) continue;
+		struct hook_index *old = *p;
+		*p = old->next;
+		trigger_free(old->trigger);
+		free(old->guard);
+		free(old);
+		break;
+	}
+
+	return h;
 }
 
 static void
 do_msg_hook(struct birch *b,
             const char *server,
             struct env *env,
-            struct line *l)
+            value arg)
 {
+	struct line *l = line(arg).l;
 	value bind = find(env, make_symbol(env, "msg-hook"));
 	if (type(bind) == VAL_NIL) return;
 
-	value arg = NIL;
+	value hooks = cdr(bind);
+	struct hook_index *h = index_hooks(b, env, hooks);
 
-	arg = cons(env, NIL, arg);
-	arg = cons(env, quickstring(env, l->trailing), arg);
-	arg = cons(env, quickstring(env, l->nick), arg);
-	arg = cons(env, quickstring(env, l->date), arg);
-	arg = quote(env, arg);
+	kdgu nick = { l->nick, strlen(l->nick), KDGU_FMT_UTF8 };
+	kdgu body = { l->trailing, strlen(l->trailing), KDGU_FMT_UTF8 };
+	bool hit[trigger_count(h->trigger) + 1];
 
-	for (value hook = cdr(bind);
+	trigger_match(h->trigger, &nick, &body, hit);
+
+	int n = 0;
+
+	for (value hook = hooks;
 	     type(hook) != VAL_NIL;
-	     hook = cdr(hook)) {
+	     hook = cdr(hook), n++) {
+		int g = n < h->num ? h->guard[n] : HOOK_UNGUARDED;
+		if (g == HOOK_INVALID || (g >= 0 && !hit[g])) continue;
+		value fn = g >= 0 ? cdr(car(hook)) : car(hook);
+
+		budget_start(env);
 		value res = eval(env,
 		                        cons(env,
-		                             car(hook),
+		                             fn,
 		                             cons(env, arg, NIL)));
+		budget_end(env);
 		if (type(res) == VAL_ERROR) {
 			puts("msg-hook error:");
 			puts(tostring(string(res)));
-			puts(tostring(string(print_value(env, car(hook)))));
+			puts(tostring(string(print_value(env, fn))));
 		} else if (type(res) != VAL_NIL) {
 			send_value(b, env, server, l->middle[0], res);
 		}
 	}
 
-	for (struct list *chan = b->channel; chan; chan = chan->next)
-		gc_mark(chan->data, ((struct env *)chan->data)->vars);
-
-	gc_mark(env, b->env->vars);
-
-	/* It doesn't matter which environment is used here. */
-	gc_sweep(env);
+	collect(b, env);
 }
 
 static void
 do_ctcp_hook(struct birch *b,
              const char *server,
              struct env *env,
-             struct line *l)
+             value arg)
 {
+	struct line *l = line(arg).l;
 	value bind = find(env, make_symbol(env, "ctcp-hook"));
 	if (type(bind) == VAL_NIL) return;
 
-	value arg = NIL;
-
-	char *tmp = strdup(strchr(l->trailing, ' ') + 1);
-	tmp[strlen(tmp) - 1] = 0;
-
-	char *ctc = strdup(l->trailing + 1);
-	*strchr(ctc, ' ') = 0;
-
-	kdgu *ctcp = kdgu_news(ctc);
-	free(ctc);
-
-	arg = cons(env, TRUE, arg);
-	arg = cons(env, quickstring(env, tmp), arg);
-	arg = cons(env, quickstring(env, l->nick), arg);
-	arg = cons(env, quickstring(env, l->date), arg);
-	arg = quote(env, arg);
-
-	free(tmp);
+	/* The CTCP command runs up to the first space or the end. */
+	kdgu *ctcp = kdgu_new(KDGU_FMT_UTF8,
+	                      l->trailing + 1,
+	                      strcspn(l->trailing + 1, " \1"));
 
 	for (value hook = cdr(bind);
 	     type(hook) != VAL_NIL;
@@ -122,10 +281,12 @@ do_ctcp_hook(struct birch *b,
 		kdgu_print(cccp, stdout), puts(">");
 		if (!kdgu_cmp(cccp, ctcp, true, NULL)) continue;
 		puts("HERE");
+		budget_start(env);
 		value res = eval(env,
 		                 cons(env,
 		                      cdr(car(hook)),
 		                      cons(env, arg, NIL)));
+		budget_end(env);
 		if (type(res) == VAL_ERROR) {
 			puts("ctcp-hook error:");
 			puts(tostring(string(res)));
@@ -135,15 +296,15 @@ do_ctcp_hook(struct birch *b,
 		}
 	}
 
-	for (struct list *chan = b->channel; chan; chan = chan->next)
-		gc_mark(chan->data, ((struct env *)chan->data)->vars);
-
-	gc_mark(env, b->env->vars);
-
-	/* It doesn't matter which environment is used here. */
-	gc_sweep(env);
+	kdgu_free(ctcp);
+	collect(b, env);
 }
 
+/*
+ * Runs the hooks for the PRIVMSG `l`, which is handed to the hooks as
+ * a line object. The line object owns `l` from then on.
+ */
+
 void
 lisp_interpret_line(struct birch *b,
                     const char *server,
@@ -152,8 +313,10 @@ lisp_interpret_line(struct birch *b,
 	struct env *env = birch_get_env(b,
 	                                server,
 	                                l->middle[0]);
+	value arg = make_line(env, l);
+
 	if (*l->trailing == 1 && *(strchr(l->trailing, 0) - 1) == 1)
-		do_ctcp_hook(b, server, env, l);
+		do_ctcp_hook(b, server, env, arg);
 	else
-		do_msg_hook(b, server, env, l);
+		do_msg_hook(b, server, env, arg);
 }
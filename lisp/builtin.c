@@ -1,12 +1,17 @@
 #include <stdlib.h>
 #include <stdbool.h>
 #include <assert.h>
+#include <ctype.h>
+#include <limits.h>
+#include <time.h>
+#include <pthread.h>
 
 #include <kdg/kdgu.h>
 
 #include "lisp.h"
 #include "../birch.h"
 #include "../util.h"
+#include "../irc.h"
 
 #include "lex.h"
 #include "eval.h"
@@ -15,6 +20,8 @@
 #include "builtin.h"
 #include "parse.h"
 #include "gc.h"
+#include "table.h"
+#include "regex.h"
 
 static value
 append(struct env *env, value list, value v)
@@ -60,12 +67,17 @@ make_function(struct env *env, value v, enum value_type type)
 	     p = cdr(p)) {
 		if (type(car(p)) == VAL_SYMBOL) {
 			param = append(env, param, car(p));
+			function(r).num_required++;
 			continue;
 		}
 
 		if (type(car(p)) == VAL_KEYWORD
 		    && kdgu_cmp(string(keyword(car(p))),
 		                &KDGU("optional"), false, NULL)) {
+			if (function(r).num_key)
+				return error(env, "`&optional' must"
+				             " precede `&key'");
+
 			value current = p;
 			p = cdr(p);
 
@@ -79,6 +91,8 @@ make_function(struct env *env, value v, enum value_type type)
 					param = append(env, param, car(car(p)));
 				}
 
+				function(r).num_optional++;
+
 				if (type(cdr(p)) == VAL_CELL) p = cdr(p), current = cdr(current);
 				else break;
 			}
@@ -104,6 +118,8 @@ make_function(struct env *env, value v, enum value_type type)
 					param = append(env, param, car(car(p)));
 				}
 
+				function(r).num_key++;
+
 				if (type(cdr(p)) == VAL_CELL) p = cdr(p), current = cdr(current);
 				else break;
 			}
@@ -417,7 +433,7 @@ builtin_cond(struct env *env, value v)
 	value cond = eval(env, car(v));
 	if (type(cond) == VAL_ERROR) return cond;
 	if (!type(cond)) return NIL;
-	return progn(env, cdr(v));
+	return tail_progn(env, cdr(v));
 }
 
 value
@@ -435,10 +451,10 @@ builtin_if(struct env *env, value v)
 		return cond;
 
 	if (type(cond))
-		return eval(env, car(cdr(v)));
+		return tail_call(env, car(cdr(v)));
 
 	/* Otherwise do the else branches. */
-	return progn(env, cdr(cdr(v)));
+	return tail_progn(env, cdr(cdr(v)));
 }
 
 value
@@ -517,7 +533,7 @@ builtin_list(struct env *env, value list)
 value
 builtin_progn(struct env *env, value v)
 {
-	return progn(env, v);
+	return tail_progn(env, v);
 }
 
 value
@@ -532,6 +548,9 @@ builtin_while(struct env *env, value v)
 	value c = NIL, r = NIL;
 
 	while (c = eval(env, car(v)), type(c)) {
+		if (type(c) == VAL_ERROR) return c;
+		r = budget_step(env);
+		if (type(r) == VAL_ERROR) return r;
 		r = progn(env, cdr(v));
 		if (type(r) == VAL_ERROR) return r;
 	}
@@ -565,7 +584,7 @@ builtin_let(struct env *env, value v)
 		add_variable(newenv, sym, val);
 	}
 
-	return progn(newenv, cdr(v));
+	return tail_progn(newenv, cdr(v));
 }
 
 value
@@ -592,14 +611,24 @@ builtin_nth(struct env *env, value v)
 	value val = eval(env, car(v));
 	if (type(val) == VAL_ERROR) return val;
 	if (!IS_LIST(val)
-	    && type(val) != VAL_STRING)
+	    && type(val) != VAL_STRING
+	    && type(val) != VAL_VECTOR
+	    && type(val) != VAL_RING)
 		return error(env,
-		             "builtin `nth' requires a list"
-		             " or string argument (this is %s %s)",
+		             "builtin `nth' requires a list, vector,"
+		             " ring or string argument (this is %s %s)",
 		             IS_VOWEL(*TYPE_NAME(type(val)))
 		             ? "an" : "a",
 		             TYPE_NAME(type(val)));
 
+	if (type(val) == VAL_VECTOR)
+		return integer(i) < vector(val).len
+			? vector(val).elem[integer(i)] : NIL;
+
+	if (type(val) == VAL_RING)
+		return integer(i) < ring(val).len
+			? ring_ref(env, val, integer(i)) : NIL;
+
 	/* `val` is either a list or a string now. */
 
 	if (!type(val)) return val;
@@ -642,10 +671,14 @@ builtin_length(struct env *env, value v)
 		return list_length(env, val);
 	} else if (type(val) == VAL_STRING) {
 		return mkint(kdgu_len(string(val)));
+	} else if (type(val) == VAL_VECTOR) {
+		return mkint(vector(val).len);
+	} else if (type(val) == VAL_RING) {
+		return mkint(ring(val).len);
 	} else {
 		return error(env,
-		             "builtin `length' takes a list"
-		             " or string argument (this is %s %s)",
+		             "builtin `length' takes a list, vector,"
+		             " ring or string argument (this is %s %s)",
 		             IS_VOWEL(*TYPE_NAME(type(val)))
 		             ? "an" : "a",
 		             TYPE_NAME(type(val)));
@@ -656,6 +689,462 @@ builtin_length(struct env *env, value v)
 	return NIL;
 }
 
+value
+builtin_vector(struct env *env, value v)
+{
+	v = eval_list(env, v);
+	if (type(v) == VAL_ERROR) return v;
+
+	value vec = make_vector(env, integer(list_length(env, v)));
+
+	for (int i = 0; type(v); v = cdr(v), i++)
+		vector(vec).elem[i] = car(v);
+
+	return vec;
+}
+
+/*
+ * Evaluates the vector and index arguments shared by `vref' and
+ * `vset' into `*vec` and `*idx`. Returns an error if they aren't a
+ * vector and an index into it, otherwise returns nil.
+ */
+
+static value
+vector_index(struct env *env,
+             const char *name,
+             value v,
+             value *vec,
+             int *idx)
+{
+	*vec = eval(env, car(v));
+	if (type(*vec) == VAL_ERROR) return *vec;
+
+	if (type(*vec) != VAL_VECTOR)
+		return error(env, "builtin `%s' requires a vector"
+		             " argument (this is %s %s)", name,
+		             IS_VOWEL(*TYPE_NAME(type(*vec)))
+		             ? "an" : "a",
+		             TYPE_NAME(type(*vec)));
+
+	value i = eval(env, car(cdr(v)));
+	if (type(i) == VAL_ERROR) return i;
+
+	if (type(i) != VAL_INT)
+		return error(env, "builtin `%s' requires a numeric"
+		             " index", name);
+
+	if (integer(i) < 0 || integer(i) >= vector(*vec).len)
+		return error(env, "index %d is out of range for"
+		             " a vector of length %d",
+		             integer(i), vector(*vec).len);
+
+	*idx = integer(i);
+
+	return NIL;
+}
+
+value
+builtin_vref(struct env *env, value v)
+{
+	if (integer(list_length(env, v)) != 2)
+		return error(env, "builtin `vref' takes"
+		             " two arguments");
+
+	value vec;
+	int i;
+
+	value err = vector_index(env, "vref", v, &vec, &i);
+	if (type(err) == VAL_ERROR) return err;
+
+	return vector(vec).elem[i];
+}
+
+value
+builtin_vset(struct env *env, value v)
+{
+	if (integer(list_length(env, v)) != 3)
+		return error(env, "builtin `vset' takes"
+		             " three arguments");
+
+	value vec;
+	int i;
+
+	value err = vector_index(env, "vset", v, &vec, &i);
+	if (type(err) == VAL_ERROR) return err;
+
+	value val = eval(env, car(cdr(cdr(v))));
+	if (type(val) == VAL_ERROR) return val;
+
+	return vector(vec).elem[i] = val;
+}
+
+value
+builtin_vlength(struct env *env, value v)
+{
+	if (integer(list_length(env, v)) != 1)
+		return error(env, "builtin `vlength' takes"
+		             " one argument");
+
+	v = eval(env, car(v));
+	if (type(v) == VAL_ERROR) return v;
+
+	if (type(v) != VAL_VECTOR)
+		return error(env, "builtin `vlength' requires a"
+		             " vector argument (this is %s %s)",
+		             IS_VOWEL(*TYPE_NAME(type(v)))
+		             ? "an" : "a",
+		             TYPE_NAME(type(v)));
+
+	return mkint(vector(v).len);
+}
+
+value
+builtin_make_ring(struct env *env, value v)
+{
+	if (integer(list_length(env, v)) != 1)
+		return error(env, "builtin `make-ring' takes"
+		             " one argument");
+
+	value cap = eval(env, car(v));
+	if (type(cap) == VAL_ERROR) return cap;
+
+	if (type(cap) != VAL_INT || integer(cap) < 0)
+		return error(env, "the capacity of a ring must be"
+		             " a non-negative integer");
+
+	return make_ring(env, integer(cap));
+}
+
+static value
+ring_arg(struct env *env, const char *name, value v)
+{
+	v = eval(env, v);
+	if (type(v) == VAL_ERROR) return v;
+
+	if (type(v) != VAL_RING)
+		return error(env, "builtin `%s' requires a ring"
+		             " argument (this is %s %s)", name,
+		             IS_VOWEL(*TYPE_NAME(type(v)))
+		             ? "an" : "a",
+		             TYPE_NAME(type(v)));
+
+	return v;
+}
+
+/*
+ * (history-search history nick pattern &optional mode limit)
+ *
+ * Returns a list of the lines in the ring `history`, newest first,
+ * whose body matches the regex `pattern` and that were said by
+ * `nick`, or by anyone if `nick` is nil. At most `limit` lines are
+ * returned if it is given.
+ */
+
+value
+builtin_history_search(struct env *env, value v)
+{
+	int len = integer(list_length(env, v));
+	if (len < 3 || len > 5)
+		return error(env, "builtin `history-search' takes"
+		             " three to five arguments");
+
+	value hist = ring_arg(env, "history-search", car(v));
+	if (type(hist) == VAL_ERROR) return hist;
+
+	v = eval_list(env, cdr(v));
+	if (type(v) == VAL_ERROR) return v;
+
+	value limit = car(cdr(cdr(cdr(v))));
+
+	if (type(limit) && type(limit) != VAL_INT)
+		return error(env, "the limit of `history-search'"
+		             " must be an integer");
+
+	struct matcher m;
+	value err = matcher_init(env, &m, "history-search",
+	                         car(v),
+	                         car(cdr(v)),
+	                         car(cdr(cdr(v))));
+	if (type(err) == VAL_ERROR) return err;
+
+	int max = type(limit) ? integer(limit) : ring(hist).len;
+	value ret = NIL, *tail = &ret;
+
+	for (int i = 0; i < ring(hist).len && max > 0; i++) {
+		value e = ring_ref(env, hist, i);
+		if (type(e) != VAL_LINE || !matcher_match(&m, line(e).l))
+			continue;
+
+		value err = budget_check(env);
+		if (type(err) == VAL_ERROR) {
+			matcher_free(&m);
+			return err;
+		}
+
+		*tail = cons(env, e, NIL);
+		tail = &cdr(*tail);
+		max--;
+	}
+
+	matcher_free(&m);
+
+	return ret;
+}
+
+/*
+ * (ring-push ring value)
+ */
+
+value
+builtin_ring_push(struct env *env, value v)
+{
+	if (integer(list_length(env, v)) != 2)
+		return error(env, "builtin `ring-push' takes"
+		             " two arguments");
+
+	value r = ring_arg(env, "ring-push", car(v));
+	if (type(r) == VAL_ERROR) return r;
+
+	value val = eval(env, car(cdr(v)));
+	if (type(val) == VAL_ERROR) return val;
+
+	ring_push(env, r, val);
+
+	return val;
+}
+
+/*
+ * (ring-ref ring index)
+ *
+ * Index 0 is the newest value. Returns nil if INDEX is past the
+ * oldest value.
+ */
+
+value
+builtin_ring_ref(struct env *env, value v)
+{
+	if (integer(list_length(env, v)) != 2)
+		return error(env, "builtin `ring-ref' takes"
+		             " two arguments");
+
+	value r = ring_arg(env, "ring-ref", car(v));
+	if (type(r) == VAL_ERROR) return r;
+
+	value i = eval(env, car(cdr(v)));
+	if (type(i) == VAL_ERROR) return i;
+
+	if (type(i) != VAL_INT || integer(i) < 0)
+		return error(env, "builtin `ring-ref' requires a"
+		             " non-negative index");
+
+	if (integer(i) >= ring(r).len) return NIL;
+
+	return ring_ref(env, r, integer(i));
+}
+
+value
+builtin_ring_capacity(struct env *env, value v)
+{
+	if (integer(list_length(env, v)) != 1)
+		return error(env, "builtin `ring-capacity' takes"
+		             " one argument");
+
+	value r = ring_arg(env, "ring-capacity", car(v));
+	if (type(r) == VAL_ERROR) return r;
+
+	return mkint(ring(r).cap);
+}
+
+value
+builtin_make_hash(struct env *env, value v)
+{
+	if (type(v))
+		return error(env, "builtin `make-hash' takes"
+		             " no arguments");
+
+	value t = gc_alloc(env, VAL_HASH);
+	table(t) = table_new();
+
+	return t;
+}
+
+/*
+ * Evaluates the key and table arguments shared by the hash table
+ * builtins into `*key` and `*t`. `key` is the first element of `v`
+ * and the table is the element `idx`. If `val` isn't NULL the second
+ * element is evaluated into it in between, so that the arguments are
+ * evaluated in order. Returns an error if they aren't a valid key and
+ * a hash table, otherwise returns nil.
+ */
+
+static value
+hash_args(struct env *env,
+          const char *name,
+          value v,
+          int idx,
+          value *key,
+          value *val,
+          value *t)
+{
+	*key = eval(env, car(v));
+	if (type(*key) == VAL_ERROR) return *key;
+
+	if (!table_key(env, *key))
+		return error(env, "builtin `%s' requires a string,"
+		             " symbol or integer key (this is %s %s)",
+		             name,
+		             IS_VOWEL(*TYPE_NAME(type(*key)))
+		             ? "an" : "a",
+		             TYPE_NAME(type(*key)));
+
+	if (val) {
+		*val = eval(env, car(cdr(v)));
+		if (type(*val) == VAL_ERROR) return *val;
+	}
+
+	while (idx--) v = cdr(v);
+
+	*t = eval(env, car(v));
+	if (type(*t) == VAL_ERROR) return *t;
+
+	if (type(*t) != VAL_HASH)
+		return error(env, "builtin `%s' requires a hash"
+		             " table (this is %s %s)", name,
+		             IS_VOWEL(*TYPE_NAME(type(*t)))
+		             ? "an" : "a",
+		             TYPE_NAME(type(*t)));
+
+	return NIL;
+}
+
+/*
+ * (gethash key table &optional default)
+ */
+
+value
+builtin_gethash(struct env *env, value v)
+{
+	int len = integer(list_length(env, v));
+	if (len != 2 && len != 3)
+		return error(env, "builtin `gethash' takes two"
+		             " or three arguments");
+
+	value key, t, val;
+
+	value err = hash_args(env, "gethash", v, 1, &key, NULL, &t);
+	if (type(err) == VAL_ERROR) return err;
+
+	if (table_get(env, table(t), key, &val))
+		return val;
+
+	if (len == 3)
+		return eval(env, car(cdr(cdr(v))));
+
+	return NIL;
+}
+
+/*
+ * (puthash key value table)
+ */
+
+value
+builtin_puthash(struct env *env, value v)
+{
+	if (integer(list_length(env, v)) != 3)
+		return error(env, "builtin `puthash' takes"
+		             " three arguments");
+
+	value key, val, t;
+
+	value err = hash_args(env, "puthash", v, 2, &key, &val, &t);
+	if (type(err) == VAL_ERROR) return err;
+
+	table_put(env, table(t), key, val);
+
+	return val;
+}
+
+/*
+ * (remhash key table)
+ */
+
+value
+builtin_remhash(struct env *env, value v)
+{
+	if (integer(list_length(env, v)) != 2)
+		return error(env, "builtin `remhash' takes"
+		             " two arguments");
+
+	value key, t;
+
+	value err = hash_args(env, "remhash", v, 1, &key, NULL, &t);
+	if (type(err) == VAL_ERROR) return err;
+
+	return table_del(env, table(t), key) ? TRUE : NIL;
+}
+
+value
+builtin_hash_count(struct env *env, value v)
+{
+	if (integer(list_length(env, v)) != 1)
+		return error(env, "builtin `hash-count' takes"
+		             " one argument");
+
+	v = eval(env, car(v));
+	if (type(v) == VAL_ERROR) return v;
+
+	if (type(v) != VAL_HASH)
+		return error(env, "builtin `hash-count' requires"
+		             " a hash table");
+
+	return mkint(table_count(table(v)));
+}
+
+static void
+collect_entry(struct env *env, value key, value val, void *list)
+{
+	*(value *)list = acons(env, key, val, *(value *)list);
+}
+
+/*
+ * (maphash function table)
+ *
+ * Calls FUNCTION with each key and value in TABLE. The entries are
+ * collected before the first call, so FUNCTION may modify TABLE.
+ */
+
+value
+builtin_maphash(struct env *env, value v)
+{
+	if (integer(list_length(env, v)) != 2)
+		return error(env, "builtin `maphash' takes"
+		             " two arguments");
+
+	value fn = eval(env, car(v));
+	if (type(fn) == VAL_ERROR) return fn;
+
+	value t = eval(env, car(cdr(v)));
+	if (type(t) == VAL_ERROR) return t;
+
+	if (type(t) != VAL_HASH)
+		return error(env, "builtin `maphash' requires"
+		             " a hash table");
+
+	value entries = NIL;
+	table_each(env, table(t), collect_entry, &entries);
+
+	for (value i = entries; type(i); i = cdr(i)) {
+		value call = cons(env, fn,
+		                  cons(env, quote(env, car(car(i))),
+		                       cons(env, quote(env, cdr(car(i))),
+		                            NIL)));
+		value res = eval(env, call);
+		if (type(res) == VAL_ERROR) return res;
+	}
+
+	return NIL;
+}
+
 /*
  * TODO: Check up on this. It looks a bit messy.
  */
@@ -693,11 +1182,18 @@ builtin_sed(struct env *env, value v)
 		}
 	}
 
-	kdgu *res = ktre_replace(string(subject),
-	                         string(pattern),
-	                         string(replace),
-	                         &KDGU("\\"),
-	                         opt);
+	ktre *re = regex_compile(string(pattern), opt);
+
+	if (re->err)
+		return error(env, "%s at index %d in %s",
+		             re->err_str,
+		             re->i,
+		             tostring(string(pattern)));
+
+	kdgu *res = ktre_filter(re,
+	                        string(subject),
+	                        string(replace),
+	                        &KDGU("\\"));
 
 	if (!res) return subject;
 
@@ -721,8 +1217,11 @@ builtin_reverse(struct env *env, value v)
 
 	value ret = NIL;
 
-	for (value i = v; type(i); i = cdr(i))
+	for (value i = v; type(i); i = cdr(i)) {
+		value err = budget_check(env);
+		if (type(err) == VAL_ERROR) return err;
 		ret = cons(env, car(i), ret);
+	}
 
 	return ret;
 }
@@ -759,7 +1258,7 @@ builtin_match(struct env *env, value v)
 		}
 	}
 
-	ktre *re = ktre_compile(pattern, opt);
+	ktre *re = regex_compile(pattern, opt);
 	int **vec;
 
 	if (re->err)
@@ -822,23 +1321,19 @@ builtin_read_string(struct env *env, value v)
 		             " must be a string");
 
 	char *s = tostring(string(car(v)));
+	size_t rest;
 
-	struct lexer *lexer = new_lexer("*string*", s);
-	struct token *t = tok(lexer);
+	value expr = parse_string(env, "read-string", s, &rest);
 
-	if (!t) return NIL;
-
-	if (t->type != '(')
-		return error(env, "builtin `read-string' expected"
-		             " `(' to begin s-expression in"
-		             " string contents");
+	if (type(expr) == VAL_NIL || type(expr) == VAL_ERROR) {
+		free(s);
+		return expr;
+	}
 
-	value expr = parse(env, lexer);
-	if (type(expr) == VAL_ERROR) return expr;
+	value ret = cons(env, expr, quickstring(env, s + rest));
+	free(s);
 
-	return cons(env,
-	            expr,
-	            quickstring(env, lexer->s + lexer->idx));
+	return ret;
 }
 
 const char *help = "Birch is an IRC bot with a CL-like Lisp"
@@ -957,6 +1452,8 @@ builtin_backtick(struct env *env, value v)
 		tail = head,
 		middle = tail;
 
+	if (type(head) == VAL_ERROR) return head;
+
 	while (type(tail)) {
 		if (type(car(tail)) == VAL_COMMA) {
 			value tmp = eval(env, keyword(car(tail)));
@@ -980,6 +1477,7 @@ builtin_backtick(struct env *env, value v)
 				return error(env, "expected a list");
 
 			tmp = gc_copy(env, tmp);
+			if (type(tmp) == VAL_ERROR) return tmp;
 			append2(env, tmp, cdr(tail));
 
 			if (middle == tail) {
@@ -1163,6 +1661,64 @@ builtin_boundp(struct env *env, value v)
 	return type(find(env, v)) ? TRUE : NIL;
 }
 
+/*
+ * Returns an association list describing evaluation budgets: the
+ * steps used by the current hook invocation, the thousands of steps
+ * used since startup (a plain count overflows an integer within days)
+ * and the number of hook invocations that were aborted for exhausting
+ * their budget.
+ */
+
+value
+builtin_budget_statistics(struct env *env, value v)
+{
+	if (type(v))
+		return error(env, "builtin `budget-statistics'"
+		             " takes no arguments");
+
+	struct env *g = env->birch->env;
+	value ret = NIL;
+
+	value aborted = mkint(g->aborted);
+	value total = mkint(g->total_steps / 1000 > INT_MAX
+	                    ? INT_MAX : g->total_steps / 1000);
+	value steps = mkint(g->steps);
+
+	ret = acons(env, make_symbol(env, "aborted"), aborted, ret);
+	ret = acons(env, make_symbol(env, "total-ksteps"), total, ret);
+	ret = acons(env, make_symbol(env, "steps"), steps, ret);
+
+	return ret;
+}
+
+/*
+ * Returns an association list of the number of lookups in the
+ * compiled regex cache that were hits and misses, and the number of
+ * programs it currently holds.
+ */
+
+value
+builtin_regex_statistics(struct env *env, value v)
+{
+	if (type(v))
+		return error(env, "builtin `regex-statistics'"
+		             " takes no arguments");
+
+	int h, m, s;
+	regex_statistics(&h, &m, &s);
+
+	value hits = mkint(h);
+	value misses = mkint(m);
+	value size = mkint(s);
+
+	value ret = NIL;
+	ret = acons(env, make_symbol(env, "size"), size, ret);
+	ret = acons(env, make_symbol(env, "misses"), misses, ret);
+	ret = acons(env, make_symbol(env, "hits"), hits, ret);
+
+	return ret;
+}
+
 #define TYPE_PREDICATE(X,Y)	  \
 	value \
 	builtin_ ## X ## p(struct env *env, value v) \
@@ -1183,6 +1739,10 @@ TYPE_PREDICATE(symbol,VAL_SYMBOL)
 TYPE_PREDICATE(builtin,VAL_BUILTIN)
 TYPE_PREDICATE(function,VAL_FUNCTION)
 TYPE_PREDICATE(macro,VAL_MACRO)
+TYPE_PREDICATE(vector,VAL_VECTOR)
+TYPE_PREDICATE(line,VAL_LINE)
+TYPE_PREDICATE(hash,VAL_HASH)
+TYPE_PREDICATE(ring,VAL_RING)
 
 void
 load_builtins(struct env *env)
@@ -1234,6 +1794,21 @@ load_builtins(struct env *env)
 	add_builtin(env, "and",     builtin_and);
 	add_builtin(env, "or",      builtin_or);
 	add_builtin(env, "append",  builtin_append);
+	add_builtin(env, "vector",  builtin_vector);
+	add_builtin(env, "vref",    builtin_vref);
+	add_builtin(env, "vset",    builtin_vset);
+	add_builtin(env, "vlength", builtin_vlength);
+	add_builtin(env, "make-ring", builtin_make_ring);
+	add_builtin(env, "ring-push", builtin_ring_push);
+	add_builtin(env, "ring-ref", builtin_ring_ref);
+	add_builtin(env, "ring-capacity", builtin_ring_capacity);
+	add_builtin(env, "history-search", builtin_history_search);
+	add_builtin(env, "make-hash", builtin_make_hash);
+	add_builtin(env, "gethash", builtin_gethash);
+	add_builtin(env, "puthash", builtin_puthash);
+	add_builtin(env, "remhash", builtin_remhash);
+	add_builtin(env, "maphash", builtin_maphash);
+	add_builtin(env, "hash-count", builtin_hash_count);
 
 	add_builtin(env, "nilp",     builtin_nilp);
 	add_builtin(env, "intp",     builtin_intp);
@@ -1243,6 +1818,16 @@ load_builtins(struct env *env)
 	add_builtin(env, "builtinp", builtin_builtinp);
 	add_builtin(env, "functionp", builtin_functionp);
 	add_builtin(env, "macrop",   builtin_macrop);
+	add_builtin(env, "vectorp",  builtin_vectorp);
+	add_builtin(env, "hashp",    builtin_hashp);
+	add_builtin(env, "ringp",    builtin_ringp);
+	add_builtin(env, "linep",    builtin_linep);
 
 	add_builtin(env, "boundp",   builtin_boundp);
+	add_builtin(env,
+	            "budget-statistics",
+	            builtin_budget_statistics);
+	add_builtin(env,
+	            "regex-statistics",
+	            builtin_regex_statistics);
 }
@@ -1,5 +1,7 @@
 #include <string.h>
 #include <assert.h>
+#include <time.h>
+#include <pthread.h>
 
 #include <kdg/kdgu.h>
 
@@ -37,20 +39,172 @@ progn(struct env *env, value list)
 	return r;
 }
 
-static value
-append(struct env *env, value list, value v)
+static long long
+now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+static int
+limit(struct env *env, const char *name)
 {
-	if (type(list) == VAL_NIL) return cons(env, v, NIL);
-	value k = list;
-	while (type(cdr(k)) != VAL_NIL) k = cdr(k);
-	cdr(k) = cons(env, v, NIL);
-	return list;
+	value bind = find(env, make_symbol(env, name));
+
+	if (type(bind) == VAL_NIL || type(cdr(bind)) != VAL_INT)
+		return -1;
+
+	return integer(cdr(bind));
+}
+
+/*
+ * Begins the evaluation budget of a top-level hook invocation in the
+ * channel environment `env`. The limits are read from the variables
+ * `step-limit' (a number of calls to `eval'), `time-limit' (in
+ * milliseconds), `alloc-limit' (objects allocated by this
+ * invocation) and `heap-limit' (objects held by the channel) as seen
+ * from `env`. Missing step and time limits are unlimited; the two
+ * object limits are never more than GC_CHANNEL_MAX. Nested calls keep
+ * the outermost budget so that hooks run from user code can't reset it.
+ */
+
+void
+budget_start(struct env *env)
+{
+	struct env *g = env->birch->env;
+	if (g->budgets++) return;
+
+	int ms = limit(env, "time-limit");
+
+	g->step_limit = limit(env, "step-limit");
+	g->deadline = ms >= 0 ? now() + ms : -1;
+	g->alloc_limit = limit(env, "alloc-limit");
+	g->heap_limit = limit(env, "heap-limit");
+
+	/* No one hook or channel may take the whole heap. */
+	if (g->alloc_limit < 0 || g->alloc_limit > GC_CHANNEL_MAX)
+		g->alloc_limit = GC_CHANNEL_MAX;
+	if (g->heap_limit < 0 || g->heap_limit > GC_CHANNEL_MAX)
+		g->heap_limit = GC_CHANNEL_MAX;
+	g->charged = env;
+	g->steps = 0;
+	g->allocs = 0;
+	g->exhausted = NULL;
+}
+
+void
+budget_end(struct env *env)
+{
+	struct env *g = env->birch->env;
+	if (--g->budgets) return;
+
+	if (g->exhausted) {
+		g->aborted++;
+		printf("evaluation aborted (%s) after %d steps"
+		       " and %d allocations\n",
+		       g->exhausted, g->steps, g->allocs);
+	}
+
+	g->step_limit = -1;
+	g->deadline = -1;
+	g->alloc_limit = -1;
+	g->heap_limit = -1;
+	g->charged = NULL;
+	g->exhausted = NULL;
+}
+
+/*
+ * Charges one step to the current budget. Returns an error if any
+ * limit of the budget has been exceeded, which stays exhausted until the hook
+ * invocation ends so that the error unwinds all the way out. The
+ * clock is only consulted every 1024 steps.
+ */
+
+value
+budget_step(struct env *env)
+{
+	struct env *g = env->birch->env;
+
+	g->steps++;
+	g->total_steps++;
+
+	if (!g->exhausted
+	    && g->step_limit >= 0
+	    && g->steps > g->step_limit)
+		g->exhausted = "step limit";
+
+	if (!g->exhausted
+	    && g->deadline >= 0
+	    && !(g->steps % 1024)
+	    && now() > g->deadline)
+		g->exhausted = "time limit";
+
+	return budget_check(env);
+}
+
+/*
+ * Returns an error if a limit of the current budget has been exceeded.
+ * Builtins that allocate in a loop of their own, without stepping,
+ * check this as they go so that one call can't run the heap through
+ * its reserve.
+ */
+
+value
+budget_check(struct env *env)
+{
+	struct env *g = env->birch->env;
+
+	if (g->exhausted)
+		return error(env, "evaluation aborted: %s exceeded",
+		             g->exhausted);
+
+	return NIL;
+}
+
+/*
+ * Returns `v` to `eval` to be evaluated in `env` in place of the
+ * builtin application that called this function, without growing
+ * the C stack. Must only be used in the return statement of a
+ * builtin or of `apply`.
+ */
+
+value
+tail_call(struct env *env, value v)
+{
+	env->birch->env->tail = env;
+	return v;
+}
+
+/*
+ * Like `progn`, but the last element of `list` is left to `eval` as
+ * a tail call.
+ */
+
+value
+tail_progn(struct env *env, value list)
+{
+	if (type(list) == VAL_NIL) return NIL;
+
+	for (; type(cdr(list)) != VAL_NIL; list = cdr(list)) {
+		value r = eval(env, car(list));
+		if (type(r) == VAL_ERROR)
+			return r;
+	}
+
+	return tail_call(env, car(list));
 }
 
 /*
  * Executes the body of the function or builtin `fn`. Returns an error
  * if `fn` is not a function or builtin.
  *
+ * Arguments are evaluated and bound in a single pass over `fnargs`
+ * using the parameter counts computed by `make_function`. Keyword
+ * arguments are consed onto the front of the new bindings so that
+ * they shadow positional arguments and defaults, which are appended
+ * to the back.
+ *
  * N.B. this function handles macros, but only after they've been
  * expanded.
  */
@@ -72,83 +226,101 @@ apply(struct env *env,
 		             ? "an" : "a",
 		             TYPE_NAME(type(fn)));;
 
-	value args = NIL, keys = NIL;
+	int required = function(fn).num_required;
+	int num_param = required
+		+ function(fn).num_optional
+		+ function(fn).num_key;
+
+	/* Check the arity before evaluating anything. */
+
+	int argc = 0;
 
 	for (value arg = fnargs;
-	     type(arg) != VAL_NIL;
+	     type(arg) == VAL_CELL;
 	     arg = cdr(arg)) {
-		if (type(car(arg)) == VAL_KEYWORDPARAM) {
-			keys = append(env, keys,
-			              cons(env, keyword(car(arg)),
-			                   car(cdr(arg))));
-			arg = cdr(arg);
-		} else {
-			args = append(env, args, car(arg));
-		}
+		if (type(car(arg)) != VAL_KEYWORDPARAM) argc++;
+		else if (type(arg = cdr(arg)) != VAL_CELL) break;
 	}
 
-	/* This is kinda complicated. */
-
-	if (integer(list_length(env, args))
-	    < integer(list_length(env, function(fn).param))
-	    - integer(list_length(env, function(fn).optional))
-	    - integer(list_length(env, function(fn).key)))
-	    return error(env, "invalid number of arguments");
+	if (argc < required)
+		return error(env, "invalid number of arguments");
 
-	if (integer(list_length(env, args))
-	    > integer(list_length(env, function(fn).param))
-	    && type(rest(fn)) == VAL_NIL)
+	if (argc > num_param && type(rest(fn)) == VAL_NIL)
 		return error(env, "too many arguments");
 
-	args = eval_list(env, args);
-	if (type(args) == VAL_ERROR) return args;
-	struct env *newenv = push_env(env, function(fn).param, args);
+	value keys = NIL, last_key = NIL;
+	value head = NIL, tail = NIL;
+	value more = NIL, last_more = NIL;
+	value p = function(fn).param, def = function(fn).optional;
+	int i = 0;
 
-	for (value opt = function(fn).optional;
-	     type(opt) != VAL_NIL;
-	     opt = cdr(opt)) {
-		value bind = find(newenv, car(car(opt)));
+	for (value arg = fnargs;
+	     type(arg) == VAL_CELL;
+	     arg = cdr(arg)) {
+		if (type(car(arg)) == VAL_KEYWORDPARAM) {
+			value sym = keyword(car(arg));
+			value val = NIL;
 
-		if (type(bind) == VAL_NIL)
-			add_variable(newenv, car(car(opt)), cdr(car(opt)));
-		else if (type(cdr(bind)) == VAL_NIL)
-			cdr(bind) = cdr(car(opt));
-	}
+			if (type(arg = cdr(arg)) == VAL_CELL) {
+				val = eval(env, car(arg));
+				if (type(val) == VAL_ERROR) return val;
+			}
 
-	for (value key = function(fn).key;
-	     type(key) != VAL_NIL;
-	     key = cdr(key)) {
-		value bind = find(newenv, car(car(key)));
-		if (type(bind) == VAL_NIL)
-			add_variable(newenv, car(car(key)), car(car(key)));
-		else if (type(cdr(bind)) == VAL_NIL)
-			cdr(bind) = cdr(car(key));
-	}
+			keys = acons(env, sym, val, keys);
+			if (type(last_key) == VAL_NIL) last_key = keys;
+			if (type(arg) != VAL_CELL) break;
+			continue;
+		}
 
-	if (type(rest(fn)) != VAL_NIL) {
-		value p = function(fn).param, q = args;
+		value val = eval(env, car(arg));
+		if (type(val) == VAL_ERROR) return val;
+
+		/* Extra arguments are collected for the REST parameter. */
 
-		while (type(p) != VAL_NIL) {
-			p = cdr(p), q = cdr(q);
-			if (type(q) == VAL_NIL) break;
+		if (i == num_param) {
+			value cell = cons(env, val, NIL);
+			if (type(more) == VAL_NIL) more = cell;
+			else cdr(last_more) = cell;
+			last_more = cell;
+			continue;
 		}
 
-		if (type(q) != VAL_NIL)
-			add_variable(newenv, function(fn).rest, q);
-		else
-			add_variable(newenv, function(fn).rest, NIL);
+		if (i++ >= required) {
+			if (type(def) == VAL_NIL) def = function(fn).key;
+			if (type(val) == VAL_NIL) val = cdr(car(def));
+			def = cdr(def);
+		}
+
+		value cell = acons(env, car(p), val, NIL);
+		if (type(head) == VAL_NIL) head = cell;
+		else cdr(tail) = cell;
+		tail = cell;
+		p = cdr(p);
+	}
+
+	/* Bind the defaults of any parameters that weren't given. */
+
+	for (; i < num_param; i++, p = cdr(p)) {
+		if (type(def) == VAL_NIL) def = function(fn).key;
+		value cell = acons(env, car(p), cdr(car(def)), NIL);
+		def = cdr(def);
+		if (type(head) == VAL_NIL) head = cell;
+		else cdr(tail) = cell;
+		tail = cell;
 	}
 
-	for (value key = keys;
-	     type(key) != VAL_NIL;
-	     key = cdr(key)) {
-		value bind = find(newenv, car(car(key)));
-		if (type(bind) == VAL_NIL)
-			add_variable(newenv, car(car(key)), cdr(car(key)));
-		else cdr(bind) = cdr(car(key));
+	if (type(rest(fn)) != VAL_NIL) {
+		value cell = acons(env, rest(fn), more, NIL);
+		if (type(head) == VAL_NIL) head = cell;
+		else cdr(tail) = cell;
+	}
+
+	if (type(last_key) != VAL_NIL) {
+		cdr(last_key) = head;
+		head = keys;
 	}
 
-	return progn(newenv, function(fn).body);
+	return tail_progn(make_env(env, head), function(fn).body);
 }
 
 /*
@@ -173,6 +345,10 @@ eval_list(struct env *env, value list)
 		if (type(tmp) == VAL_ERROR)
 			return tmp;
 
+		value err = budget_check(env);
+		if (type(err) == VAL_ERROR)
+			return err;
+
 		if (type(head) == VAL_NIL) {
 			head = tail = cons(env, tmp, NIL);
 			continue;
@@ -186,7 +362,9 @@ eval_list(struct env *env, value list)
 }
 
 /*
- * Evaluates a node and returns the result.
+ * Evaluates a node and returns the result. Tail calls requested by
+ * builtins through `tail_call` are evaluated by looping here instead
+ * of recursing.
  */
 
 value
@@ -203,6 +381,13 @@ eval(struct env *env, value v)
 
 	value ret = NIL;
 
+ loop:
+	ret = budget_step(env);
+	if (type(ret) == VAL_ERROR) {
+		env->birch->env->depth--;
+		return ret;
+	}
+
 	switch (type(v)) {
 	/*
 	 * These are values that don't require any further
@@ -213,7 +398,9 @@ eval(struct env *env, value v)
 	case VAL_BUILTIN: case VAL_FUNCTION:
 	case VAL_ERROR:   case VAL_TRUE:
 	case VAL_NIL:     case VAL_KEYWORD:
-	case VAL_KEYWORDPARAM:
+	case VAL_KEYWORDPARAM: case VAL_VECTOR:
+	case VAL_HASH:    case VAL_RING:
+	case VAL_LINE:
 		ret = v;
 		break;
 
@@ -231,8 +418,8 @@ eval(struct env *env, value v)
 		value expanded = expand(env, v);
 
 		if (expanded != v) {
-			ret = eval(env, expanded);
-			break;
+			v = expanded;
+			goto loop;
 		}
 
 		value fn = eval(env, car(v));
@@ -244,6 +431,13 @@ eval(struct env *env, value v)
 		}
 
 		ret = apply(env, fn, args);
+
+		if (env->birch->env->tail) {
+			env = env->birch->env->tail;
+			env->birch->env->tail = NULL;
+			v = ret;
+			goto loop;
+		}
 		break;
 	}
 
@@ -282,13 +476,16 @@ eval_string(struct env *env, const char *code)
 	struct lexer *lexer = new_lexer("*string*", code);
 	struct token *t = tok(lexer);
 
-	if (t->type != '(')
+	if (!t || t->type != '(') {
+		lexer_free(lexer);
 		return error(env, "malformed s-expression in"
 		             " call to eval_string");
+	}
 
 	#include "parse.h"
 
 	value v = parse(env, lexer);
+	lexer_free(lexer);
 	if (type(v) == VAL_ERROR) return v;
 	return eval(env, v);
 }
@@ -1,4 +1,10 @@
 value progn(struct env *env, value v);
+value tail_progn(struct env *env, value v);
+value tail_call(struct env *env, value v);
 value eval_list(struct env *env, value v);
 value eval(struct env *env, value v);
 value eval_string(struct env *env, const char *code);
+void budget_start(struct env *env);
+void budget_end(struct env *env);
+value budget_step(struct env *env);
+value budget_check(struct env *env);
@@ -1,6 +1,8 @@
 #include <kdg/kdgu.h>
 #include <stdint.h>
 #include <assert.h>
+#include <time.h>
+#include <pthread.h>
 
 #include "lisp.h"
 #include "../list.h"
@@ -8,6 +10,9 @@
 #include "lex.h"
 #include "gc.h"
 #include "error.h"
+#include "eval.h"
+#include "table.h"
+#include "../irc.h"
 
 struct gc *
 gc_new(void)
@@ -55,6 +60,27 @@ free_object(struct env *env, value v)
 		kdgu_free(string(v));
 		string(v) = NULL;
 		break;
+	case VAL_VECTOR:
+		free(vector(v).elem);
+		vector(v).elem = NULL;
+		break;
+	case VAL_HASH:
+		table_free(table(v));
+		table(v) = NULL;
+		break;
+	case VAL_RING:
+		free(ring(v).elem);
+		ring(v).elem = NULL;
+		break;
+	case VAL_LINE:
+		line_free(line(v).l);
+		line(v).l = NULL;
+		break;
+	case VAL_ENV:
+		frame(v)->up = env->gc->pool;
+		env->gc->pool = frame(v);
+		frame(v) = NULL;
+		break;
 	default:;
 	}
 	bmp_free(env->gc->bmp, v);
@@ -73,6 +99,24 @@ gc_sweep(struct env *env)
 		if (!marked(i))
 			free_object(env, i);
 	memset(gc->mark, 0, (GC_MAX_OBJECT / 64) * sizeof *gc->mark);
+	gc_count(gc);
+
+	/* A full heap outside of any hook ends with the collection. */
+	struct env *g = env->birch->env;
+	if (!g->budgets) g->exhausted = NULL;
+}
+
+/*
+ * Recounts the allocated objects after the allocation bitmap has been
+ * rewritten wholesale.
+ */
+
+void
+gc_count(struct gc *gc)
+{
+	gc->live = 0;
+	for (int i = 0; i < GC_MAX_OBJECT / 64; i++)
+		gc->live += __builtin_popcountll(gc->bmp[i]);
 }
 
 value
@@ -80,69 +124,201 @@ gc_alloc(struct env *env, enum value_type type)
 {
 	struct gc *gc = env->gc;
 	int64_t idx = bmp_alloc(gc->bmp, GC_MAX_OBJECT);
-	if (idx < 0 || idx >= GC_MAX_OBJECT) exit(1);
+
+	/* Only the reserve running out is fatal; see GC_RESERVE. */
+	if (idx < 0 || idx >= GC_MAX_OBJECT) {
+		fputs("fatal: the heap reserve is exhausted\n", stderr);
+		exit(1);
+	}
+
+	memset(&gc->obj[idx], 0, sizeof *gc->obj);
 	type(idx) = type;
+	gc->live++;
+
+	/*
+	 * Charge the allocation to the current evaluation and its
+	 * channel. Going over a quota doesn't fail the allocation;
+	 * the evaluation is aborted at its next step instead.
+	 */
+	struct env *g = env->birch->env, *c = g->charged;
+	g->allocs++;
+
+	if (c && ++c->usage > c->peak)
+		c->peak = c->usage;
+
+	if (!g->exhausted && gc->live > GC_MAX_OBJECT - GC_RESERVE)
+		g->exhausted = "heap full";
+
+	if (!g->exhausted
+	    && g->alloc_limit >= 0
+	    && g->allocs > g->alloc_limit)
+		g->exhausted = "allocation quota";
+
+	if (!g->exhausted && c
+	    && g->heap_limit >= 0
+	    && c->usage > g->heap_limit)
+		g->exhausted = "channel heap quota";
+
 	return idx;
 }
 
+static void
+copy_entry(struct env *env, value key, value val, void *t)
+{
+	table_put(env, t, key, val);
+}
+
+/*
+ * Copies the structure of `v`. Values that stand for something with an
+ * identity of its own, like functions and environments, are shared
+ * with the original rather than copied, and so are nil and t.
+ * Returns an error if the copy can't be made or would run over the
+ * current budget.
+ */
+
 value
 gc_copy(struct env *env, value v)
 {
-	value ret = gc_alloc(env, type(v));
+	value ret = budget_check(env);
+	if (type(ret) == VAL_ERROR) return ret;
 
 	switch (type(v)) {
 	case VAL_COMMA:
 	case VAL_COMMAT:
+		ret = gc_alloc(env, type(v));
 		keyword(ret) = gc_copy(env, keyword(v));
+		if (type(keyword(ret)) == VAL_ERROR) return keyword(ret);
 		break;
 	case VAL_SYMBOL:
+	case VAL_STRING:
+		ret = gc_alloc(env, type(v));
 		string(ret) = kdgu_copy(string(v));
 		break;
 	case VAL_INT:
+		ret = gc_alloc(env, type(v));
 		integer(ret) = integer(v);
 		break;
-	case VAL_STRING:
-		string(ret) = kdgu_copy(string(v));
-		break;
 	case VAL_CELL:
+		ret = gc_alloc(env, type(v));
 		car(ret) = gc_copy(env, car(v));
+		if (type(car(ret)) == VAL_ERROR) return car(ret);
 		cdr(ret) = gc_copy(env, cdr(v));
+		if (type(cdr(ret)) == VAL_ERROR) return cdr(ret);
 		break;
-	case VAL_NIL:
-	case VAL_TRUE:
+	case VAL_VECTOR:
+		ret = gc_alloc(env, type(v));
+		vector(ret).len = vector(v).len;
+		vector(ret).elem = calloc(vector(v).len + 1,
+		                          sizeof *vector(v).elem);
+		for (int i = 0; i < vector(v).len; i++) {
+			value e = gc_copy(env, vector(v).elem[i]);
+			if (type(e) == VAL_ERROR) return e;
+			vector(ret).elem[i] = e;
+		}
+		break;
+	case VAL_HASH:
+		/* The new table shares the keys and values. */
+		ret = gc_alloc(env, type(v));
+		table(ret) = table_new();
+		table_each(env, table(v), copy_entry, table(ret));
 		break;
+	case VAL_RING: {
+		value *elem = calloc(ring(v).cap + 1, sizeof *elem);
+		if (!elem) return error(env, "out of memory");
+		memcpy(elem, ring(v).elem, ring(v).cap * sizeof *elem);
+		ret = gc_alloc(env, type(v));
+		ring(ret) = ring(v);
+		ring(ret).elem = elem;
+	} break;
+	case VAL_LINE: {
+		/* A line is parsed again from its text, like in images. */
+		struct line *l = line_new(line(v).l->text, line(v).l->time);
+		if (!l) return error(env, "out of memory");
+		ret = gc_alloc(env, type(v));
+		line(ret) = line(v);
+		line(ret).l = l;
+	} break;
 	default:
-		/* TODO: ... */
-		printf("ojmsifjoisej: %s\n", TYPE_NAME(type(v)));
+		return v;
 	}
 
 	return ret;
 }
 
-void
+static void
+mark_entry(struct env *env, value key, value val, void *n)
+{
+	*(int *)n += gc_mark(env, key);
+	*(int *)n += gc_mark(env, val);
+}
+
+/*
+ * Marks everything reachable from `v` and returns the number of
+ * objects that weren't already marked.
+ */
+
+int
 gc_mark(struct env *env, value v)
 {
+	if (marked(v)) return 0;
 	mark(v);
+
+	int n = 1;
+
 	switch (type(v)) {
 	case VAL_CELL:
-		gc_mark(env, car(v));
-		gc_mark(env, cdr(v));
+		n += gc_mark(env, car(v));
+		n += gc_mark(env, cdr(v));
+
+		/*
+		 * A memoized expansion lives exactly as long as its
+		 * call site.
+		 */
+		if (type(macro(v)) != VAL_NIL) {
+			n += gc_mark(env, macro(v));
+			n += gc_mark(env, expansion(v));
+		}
 		break;
 	case VAL_COMMA:
 	case VAL_COMMAT:
 	case VAL_KEYWORDPARAM:
 	case VAL_KEYWORD:
-		gc_mark(env, keyword(v));
+		n += gc_mark(env, keyword(v));
 		break;
 	case VAL_MACRO:
 	case VAL_FUNCTION:
-		gc_mark(env, param(v));
-		gc_mark(env, body(v));
-		gc_mark(env, optional(v));
-		gc_mark(env, key(v));
-		gc_mark(env, rest(v));
-		gc_mark(env, docstring(v));
+		n += gc_mark(env, param(v));
+		n += gc_mark(env, body(v));
+		n += gc_mark(env, optional(v));
+		n += gc_mark(env, key(v));
+		n += gc_mark(env, rest(v));
+		n += gc_mark(env, docstring(v));
+		if (env(v)) n += gc_mark(env, env(v)->obj);
+		break;
+	case VAL_VECTOR:
+		for (int i = 0; i < vector(v).len; i++)
+			n += gc_mark(env, vector(v).elem[i]);
+		break;
+	case VAL_HASH:
+		table_each(env, table(v), mark_entry, &n);
+		break;
+	case VAL_RING:
+		for (int i = 0; i < ring(v).len; i++)
+			n += gc_mark(env, ring(v).elem[i]);
+		break;
+	case VAL_LINE:
+		n += gc_mark(env, line(v).nick);
+		n += gc_mark(env, line(v).body);
+		n += gc_mark(env, line(v).time);
+		n += gc_mark(env, line(v).host);
+		n += gc_mark(env, line(v).channel);
+		break;
+	case VAL_ENV:
+		n += gc_mark(env, frame(v)->vars);
+		if (frame(v)->up) n += gc_mark(env, frame(v)->up->obj);
 		break;
 	default:;
 	}
+
+	return n;
 }
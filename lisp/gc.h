@@ -2,17 +2,55 @@ struct gc {
 	uint64_t *bmp;
 	uint64_t *mark;
 
+	/* Allocated objects, recounted by every sweep. */
+	int64_t live;
+
+	/* Collected environment frames, linked through `up`. */
+	struct env *pool;
+
 	struct {
 		union {
+			struct env *frame;
+			struct table *table;
 			kdgu *string;
 			value keyword;
 			builtin *builtin;
 			int integer;
 
+			/*
+			 * `macro` and `expansion` memoize the expansion
+			 * of a macro call whose call site is this cell;
+			 * see `expand`.
+			 */
 			struct {
 				value car, cdr;
+				value macro, expansion;
 			} cell;
 
+			/* Contiguous storage for `len` elements. */
+			struct {
+				value *elem;
+				int len;
+			} vector;
+
+			/*
+			 * The last `len` (at most `cap`) values
+			 * pushed; the next one goes in `head`.
+			 */
+			struct {
+				value *elem;
+				int cap, len, head;
+			} ring;
+
+			/*
+			 * A parsed IRC line and the strings that have
+			 * been made from it so far (nil until then).
+			 */
+			struct {
+				struct line *l;
+				value nick, body, time, host, channel;
+			} line;
+
 			struct {
 				kdgu *name;
 				value param;
@@ -23,6 +61,15 @@ struct gc {
 				value key;
 				value rest;
 				value docstring;
+
+				/*
+				 * Computed by `make_function`; `param`
+				 * holds the required parameters, then
+				 * the optional ones, then the keys.
+				 */
+				int num_required;
+				int num_optional;
+				int num_key;
 			} function;
 		};
 
@@ -34,8 +81,15 @@ struct gc {
 #define integer(X) (env->gc->obj[(X)].integer)
 #define builtin(X) (env->gc->obj[(X)].builtin)
 #define string(X) (env->gc->obj[(X)].string)
+#define frame(X) (env->gc->obj[(X)].frame)
+#define table(X) (env->gc->obj[(X)].table)
 #define car(X) (env->gc->obj[(X)].cell.car)
 #define cdr(X) (env->gc->obj[(X)].cell.cdr)
+#define vector(X) (env->gc->obj[(X)].vector)
+#define ring(X) (env->gc->obj[(X)].ring)
+#define line(X) (env->gc->obj[(X)].line)
+#define macro(X) (env->gc->obj[(X)].cell.macro)
+#define expansion(X) (env->gc->obj[(X)].cell.expansion)
 
 #define function(X) (env->gc->obj[(X)].function)
 #define optional(X) (env->gc->obj[(X)].function.optional)
@@ -61,8 +115,9 @@ struct gc {
 struct gc *gc_new(void);
 value gc_alloc(struct env *env, enum value_type type);
 value gc_copy(struct env *env, value v);
-void gc_mark(struct env *env, value v);
+int gc_mark(struct env *env, value v);
 void gc_sweep(struct env *env);
+void gc_count(struct gc *gc);
 
 static value
 mkint(struct env *env, int n)
@@ -75,3 +130,16 @@ mkint(struct env *env, int n)
 #define mkint(X) mkint(env, (X));
 
 #define GC_MAX_OBJECT (10000*64)
+
+/*
+ * Once all but GC_RESERVE objects are allocated the heap counts as
+ * full: the running hook is aborted, but its allocations keep being
+ * served from the reserve until it has unwound.
+ */
+#define GC_RESERVE (GC_MAX_OBJECT / 16)
+
+/*
+ * The most a single hook invocation may allocate and a single channel
+ * may hold, whatever `alloc-limit' and `heap-limit' say.
+ */
+#define GC_CHANNEL_MAX (GC_MAX_OBJECT / 8)
@@ -26,18 +26,39 @@ struct token {
 	 */
 
 	union {
-		kdgu *s;       /* String contents.                  */
+		struct {
+			char *s;       /* String contents.          */
+			unsigned slen;
+		};
 		int i;         /* Integer.                          */
 	};
 };
 
+/* A block of scratch memory for tokens; see `lexer_alloc`. */
+struct chunk {
+	struct chunk *next;
+	size_t used, size;
+	char data[];
+};
+
 struct lexer {
 	const char *file;      /* Filename.                         */
 	const char *s;         /* Input stream.                     */
 	const char *e;         /* End of input stream.              */
 	unsigned idx;          /* Current character.                */
 	unsigned len, line, column;
+
+	/*
+	 * Tokens and their text live in `arena`, which is emptied
+	 * whenever `parse` finishes a top-level expression (when
+	 * `depth` drops back to zero). Only the objects the parser
+	 * made from them outlive that.
+	 */
+	struct chunk *arena;
+	int depth;
 };
 
 struct lexer *new_lexer(const char *file, const char *s);
+void lexer_reset(struct lexer *l);
+void lexer_free(struct lexer *l);
 struct token *tok(struct lexer *l);
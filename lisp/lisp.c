@@ -2,6 +2,8 @@
 #include <string.h>
 #include <assert.h>
 #include <stdbool.h>
+#include <time.h>
+#include <pthread.h>
 #include <kdg/kdgu.h>
 
 #include "lex.h"
@@ -10,9 +12,11 @@
 #include "builtin.h"
 #include "eval.h"
 #include "gc.h"
+#include "table.h"
 
 #include "../birch.h"
 #include "../util.h"
+#include "../irc.h"
 
 const char **value_name = (const char *[]){
 	"nil",
@@ -28,6 +32,10 @@ const char **value_name = (const char *[]){
 	"keyword",
 	"comma",
 	"commat",
+	"vector",
+	"hash",
+	"ring",
+	"line",
 	"true",
 	"rparen",
 	"dot",
@@ -65,80 +73,134 @@ list_length(struct env *env, value list)
 	return mkint(len);
 }
 
-value
-print_value(struct env *env, value v)
+/*
+ * The printer writes everything into a single buffer. Once `limit'
+ * bytes have been written it sets `truncated' and every caller
+ * unwinds without printing anything more, so printing the start of a
+ * huge structure only costs as much as the part that is kept.
+ */
+
+struct printer {
+	char *buf;
+	size_t len, cap, limit;
+	bool truncated;
+};
+
+static void
+emit(struct printer *p, const char *s, size_t n)
+{
+	if (p->truncated) return;
+
+	if (n > p->limit - p->len) {
+		n = p->limit - p->len;
+		p->truncated = true;
+	}
+
+	if (p->len + n > p->cap) {
+		while (p->len + n > p->cap) p->cap *= 2;
+		p->buf = realloc(p->buf, p->cap);
+	}
+
+	memcpy(p->buf + p->len, s, n);
+	p->len += n;
+}
+
+static void
+emit_string(struct printer *p, const kdgu *k)
+{
+	emit(p, k->s, k->len);
+}
+
+static value
+print_into(struct env *env, struct printer *p, value v)
 {
-	kdgu *out = kdgu_news("");
 	char buf[256];
 
 	switch (type(v)) {
 	case VAL_COMMA:
-		kdgu_chrappend(out, ',');
-		/* TODO: Ensure print_value returns a string. */
-		kdgu_append(out, string(print_value(env, keyword(v))));
-		break;
-	case VAL_SYMBOL: out = kdgu_copy(string(v)); break;
+		emit(p, ",", 1);
+		return print_into(env, p, keyword(v));
+	case VAL_SYMBOL: emit_string(p, string(v)); break;
 	case VAL_STRING:
-		kdgu_chrappend(out, '"');
-		kdgu_append(out, string(v));
-		kdgu_chrappend(out, '"');
+		emit(p, "\"", 1);
+		emit_string(p, string(v));
+		emit(p, "\"", 1);
 		break;
 	case VAL_INT:
-		sprintf(buf, "%d", integer(v));
-		out = kdgu_news(buf);
+		emit(p, buf, sprintf(buf, "%d", integer(v)));
 		break;
-	case VAL_TRUE: out = kdgu_news("t");        break;
-	case VAL_NIL:  out = kdgu_news("()");       break;
+	case VAL_TRUE: emit(p, "t", 1);  break;
+	case VAL_NIL:  emit(p, "()", 2); break;
 	case VAL_MACRO:
 	case VAL_FUNCTION:
 		if (function(v).name) {
 			kdgu *tmp = kdgu_copy(function(v).name);
 			kdgu_uc(tmp);
-			kdgu_append(out, tmp);
+			emit_string(p, tmp);
+			kdgu_free(tmp);
 		} else
-			kdgu_append(out, &KDGU("anonymous function"));
+			emit_string(p, &KDGU("anonymous function"));
 		break;
 	case VAL_BUILTIN:
-		out = kdgu_news("<builtin>");
+		emit_string(p, &KDGU("<builtin>"));
+		break;
+	case VAL_HASH:
+		emit(p, buf, sprintf(buf, "<hash table of %zu>",
+		                     table_count(table(v))));
 		break;
+	case VAL_RING:
+		emit(p, buf, sprintf(buf, "<ring of %d/%d>",
+		                     ring(v).len, ring(v).cap));
+		break;
+	case VAL_LINE: {
+		int n = snprintf(buf, sizeof buf, "<line from %s>",
+		                 line(v).l->nick);
+		emit(p, buf, n < (int)sizeof buf ? n : sizeof buf - 1);
+	} break;
 	case VAL_KEYWORD:
-		sprintf(buf, "&%.*s",
-		        string(keyword(v))->len, string(keyword(v))->s);
-		out = kdgu_news(buf);
+		emit(p, "&", 1);
+		emit_string(p, string(keyword(v)));
 		break;
 	case VAL_KEYWORDPARAM:
-		sprintf(buf, ":%.*s",
-		        string(keyword(v))->len, string(keyword(v))->s);
-		out = kdgu_news(buf);
+		emit(p, ":", 1);
+		emit_string(p, string(keyword(v)));
 		break;
 	case VAL_CELL:
-		kdgu_chrappend(out, '(');
+		emit(p, "(", 1);
 
-		while (type(v) == VAL_CELL) {
-			value e = print_value(env, car(v));
+		while (type(v) == VAL_CELL && !p->truncated) {
+			value e = print_into(env, p, car(v));
 			if (type(e) == VAL_ERROR) return e;
-			kdgu_append(out, string(e));
 			if (type(cdr(v)) == VAL_CELL)
-				kdgu_chrappend(out, ' ');
+				emit(p, " ", 1);
 			v = cdr(v);
 		}
 
-		if (type(v) != VAL_NIL) {
-			kdgu_chrappend(out, ' ');
-			/*
-			 * TODO: This can break and probably other
-			 * things in this function too.
-			 */
-			kdgu_append(out, string(print_value(env, v)));
+		if (type(v) != VAL_NIL && type(v) != VAL_CELL) {
+			emit(p, " ", 1);
+			value e = print_into(env, p, v);
+			if (type(e) == VAL_ERROR) return e;
+		}
+
+		emit(p, ")", 1);
+		break;
+	case VAL_VECTOR:
+		emit(p, "#(", 2);
+
+		for (int i = 0; i < vector(v).len && !p->truncated; i++) {
+			value e = print_into(env, p, vector(v).elem[i]);
+			if (type(e) == VAL_ERROR) return e;
+			if (i + 1 < vector(v).len)
+				emit(p, " ", 1);
 		}
 
-		kdgu_chrappend(out, ')');
+		emit(p, ")", 1);
 		break;
 	case VAL_DOT:
-		kdgu_chrappend(out, '.');
+		emit(p, ".", 1);
 		break;
 	case VAL_ERROR:
-		kdgu_append(out, string(print_error(env, v)));
+		emit_string(p, string(print_error(env, v)));
 		break;
 	default:
 		return error(env,
@@ -147,12 +209,60 @@ print_value(struct env *env, value v)
 		             TYPE_NAME(type(v)), type(v));
 	}
 
-	value e = gc_alloc(env, VAL_STRING);
-	string(e) = out;
+	return NIL;
+}
+
+/*
+ * Prints `v' into a string of at most `limit' bytes. Output that
+ * doesn't fit is cut at the last whole character and followed by
+ * PRINT_MARKER.
+ */
+
+value
+print_value_limit(struct env *env, value v, size_t limit)
+{
+	struct printer p = {
+		.buf = malloc(64),
+		.cap = 64,
+		.limit = limit,
+	};
+
+	value e = print_into(env, &p, v);
+
+	if (type(e) == VAL_ERROR) {
+		free(p.buf);
+		return e;
+	}
+
+	if (p.truncated) {
+		/* Don't leave half of a UTF-8 sequence at the end. */
+		size_t i = p.len;
+		while (i && (p.buf[i - 1] & 0xC0) == 0x80) i--;
+
+		if (i) {
+			unsigned char c = p.buf[i - 1];
+			size_t n = c >= 0xF0 ? 4 : c >= 0xE0 ? 3 : c >= 0xC0 ? 2 : 1;
+			p.len = i - 1 + n <= p.len ? p.len : i - 1;
+		}
+
+		p.limit = (size_t)-1;
+		p.truncated = false;
+		emit(&p, PRINT_MARKER, strlen(PRINT_MARKER));
+	}
+
+	e = gc_alloc(env, VAL_STRING);
+	string(e) = kdgu_new(KDGU_FMT_UTF8, p.buf, p.len);
+	free(p.buf);
 
 	return e;
 }
 
+value
+print_value(struct env *env, value v)
+{
+	return print_value_limit(env, v, (size_t)-1);
+}
+
 value
 cons(struct env *env, value car, value cdr)
 {
@@ -182,6 +292,88 @@ make_symbol(struct env *env, const char *s)
 	return sym;
 }
 
+/*
+ * Returns a new vector of `len` elements, all of which are nil.
+ */
+
+value
+make_vector(struct env *env, int len)
+{
+	value v = gc_alloc(env, VAL_VECTOR);
+	vector(v).elem = calloc(len + 1, sizeof *vector(v).elem);
+	vector(v).len = len;
+	return v;
+}
+
+/*
+ * Returns a new empty ring buffer that holds at most `cap` values, or
+ * an error if `cap` is more than one channel may hold or the buffer
+ * can't be allocated.
+ */
+
+value
+make_ring(struct env *env, int cap)
+{
+	if (cap < 0 || cap > GC_CHANNEL_MAX)
+		return error(env, "the capacity of a ring must be"
+		             " at most %d", GC_CHANNEL_MAX);
+
+	value *elem = calloc(cap + 1, sizeof *elem);
+	if (!elem) return error(env, "out of memory");
+
+	value r = gc_alloc(env, VAL_RING);
+	ring(r).elem = elem;
+	ring(r).cap = cap;
+	return r;
+}
+
+/*
+ * Pushes `v` onto the ring buffer `r`, overwriting (and so
+ * releasing) the oldest value if the buffer is full.
+ */
+
+void
+ring_push(struct env *env, value r, value v)
+{
+	if (!ring(r).cap) return;
+	ring(r).elem[ring(r).head] = v;
+	ring(r).head = (ring(r).head + 1) % ring(r).cap;
+	if (ring(r).len < ring(r).cap) ring(r).len++;
+}
+
+/*
+ * Returns the `i`th newest value in the ring buffer `r`, which must
+ * be in range.
+ */
+
+value
+ring_ref(struct env *env, value r, int i)
+{
+	return ring(r).elem[(ring(r).head - 1 - i + ring(r).cap)
+	                    % ring(r).cap];
+}
+
+/*
+ * Returns a new line object that takes ownership of `l`. Its fields
+ * are only turned into strings when they are asked for.
+ */
+
+value
+make_line(struct env *env, struct line *l)
+{
+	value v = gc_alloc(env, VAL_LINE);
+	line(v).l = l;
+	return v;
+}
+
+/*
+ * Returns the expansion of `v` if it is a macro call, otherwise
+ * returns `v`. The expansion is memoized in the call site itself and
+ * reused for as long as the symbol in function position is bound to
+ * the same macro, so redefining a macro invalidates every expansion
+ * made with the old definition.
+ */
+
 value
 expand(struct env *env, value v)
 {
@@ -195,6 +387,9 @@ expand(struct env *env, value v)
 
 	value fn = cdr(bind), args = cdr(v);
 
+	if (macro(v) == fn)
+		return expansion(v);
+
 	struct env *newenv = push_env(env, function(fn).param, args);
 
 	for (value opt = function(fn).optional;
@@ -222,7 +417,13 @@ expand(struct env *env, value v)
 		             type(q) != VAL_NIL ? q : NIL);
 	}
 
-	return progn(newenv, function(fn).body);
+	value ret = progn(newenv, function(fn).body);
+	if (type(ret) == VAL_ERROR) return ret;
+
+	macro(v) = fn;
+	expansion(v) = ret;
+
+	return ret;
 }
 
 /*
@@ -283,21 +484,22 @@ load_macros(struct env *env)
 	eval_string(env, "(defmacro not (x) ~(null ,x))");
 	eval_string(env, "\
 (defmacro map (x y)\
-  ~(if (cdr ,y)\
-       (cons (,x (car ,y)) (map ,x (cdr ,y)))\
-     (cons (,x (car ,y)) nil)))");
+  ~(let ((%map-in ,y) (%map-out nil))\
+     (while %map-in\
+       (setq %map-out (cons (,x (car %map-in)) %map-out))\
+       (setq %map-in (cdr %map-in)))\
+     (reverse %map-out)))");
 }
 
 /*
- * This should only ever be called to construct the global
- * environment. All others should be constructed with `push_env` using
- * the global environment as the first parameter.
+ * Constructs a global environment whose heap holds only the
+ * constants; see `new_environment`.
  */
 
 struct env *
-new_environment(struct birch *b,
-                const char *server,
-                const char *channel)
+empty_environment(struct birch *b,
+                  const char *server,
+                  const char *channel)
 {
 	struct env *env = malloc(sizeof *env);
 
@@ -311,6 +513,24 @@ new_environment(struct birch *b,
 	env->protect = false;
 	env->recursion_limit = -1;
 	env->depth = 0;
+	env->tail = NULL;
+	env->budgets = 0;
+	env->step_limit = -1;
+	env->steps = 0;
+	env->deadline = -1;
+	env->alloc_limit = -1;
+	env->allocs = 0;
+	env->heap_limit = -1;
+	env->charged = NULL;
+	env->exhausted = NULL;
+	env->usage = 0;
+	env->peak = 0;
+	env->store = NULL;
+	env->index = NULL;
+	env->backfill = NULL;
+	env->index_first = env->index_end = 0;
+	env->total_steps = 0;
+	env->aborted = 0;
 	b->env = env;
 
 	/* Initialize constant values. */
@@ -320,6 +540,24 @@ new_environment(struct birch *b,
 	TRUE = gc_alloc(env, VAL_TRUE);
 	VEOF = gc_alloc(env, VAL_EOF);
 
+	env->obj = NIL;
+
+	return env;
+}
+
+/*
+ * This should only ever be called to construct the global
+ * environment. All others should be constructed with `push_env` using
+ * the global environment as the first parameter.
+ */
+
+struct env *
+new_environment(struct birch *b,
+                const char *server,
+                const char *channel)
+{
+	struct env *env = empty_environment(b, server, channel);
+
 	/*
 	 * Note: These should only be done here (in the initialization
 	 * for the global environment) because it's redundant to load
@@ -332,13 +570,26 @@ new_environment(struct birch *b,
 	return env;
 }
 
+/*
+ * Builds a new environment below `env` binding the variables in the
+ * association list `map`. The frame is owned by a `VAL_ENV` object
+ * and is reused once that object is collected.
+ */
+
 struct env *
 make_env(struct env *env, value map)
 {
-	struct env *r = malloc(sizeof *r);
+	struct env *r = env->gc->pool;
+
+	if (r) env->gc->pool = r->up;
+	else r = malloc(sizeof *r);
+
 	memcpy(r, env, sizeof *r);
 	r->vars = map;
 	r->up = env;
+	r->obj = gc_alloc(env, VAL_ENV);
+	frame(r->obj) = r;
+
 	return r;
 }
 
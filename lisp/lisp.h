@@ -18,6 +18,10 @@ enum value_type {
 	VAL_KEYWORD,
 	VAL_COMMA,
 	VAL_COMMAT,
+	VAL_VECTOR,
+	VAL_HASH,
+	VAL_RING,
+	VAL_LINE,
 
 	VAL_TRUE,
 
@@ -32,6 +36,9 @@ enum value_type {
 
 typedef int value;
 
+/* A parsed IRC line; see irc.h. */
+struct line;
+
 /* Environment. */
 struct env {
 	value vars;
@@ -45,7 +52,14 @@ struct env {
 	char *server, *channel;
 
 	struct birch *birch;
-	struct object *obj;
+
+	/*
+	 * The `VAL_ENV` object that owns this environment. The
+	 * environment is returned to the frame pool when it is
+	 * collected. The global environment is never collected and
+	 * uses NIL here.
+	 */
+	value obj;
 
 	struct gc *gc;
 
@@ -53,8 +67,52 @@ struct env {
 	bool protect;
 	int recursion_limit;
 	int depth;
+
+	/*
+	 * Evaluation budget of the current top-level hook invocation;
+	 * see `budget_start`. A limit of -1 means unlimited.
+	 */
+	int budgets;            /* Nesting of `budget_start`.        */
+	int step_limit, steps;
+	long long deadline;     /* Monotonic milliseconds, or -1.    */
+	int alloc_limit, allocs;
+	int heap_limit;         /* Applies to `charged->usage`.      */
+	struct env *charged;    /* Channel charged for allocations.  */
+	const char *exhausted;  /* The limit that was hit, or NULL.  */
+
+	/*
+	 * Heap accounting for channel environments: the number of
+	 * objects reachable from the channel as of the last
+	 * collection plus those allocated since, and its maximum.
+	 */
+	int usage, peak;
+
+	/*
+	 * The on-disk history of a channel, opened on first use, and
+	 * its trigram index if `log-index` was set then. The index
+	 * covers the lines from `index_first` up to `index_end`, once
+	 * the `backfill` of the lines it held when it was opened is
+	 * merged in.
+	 */
+	struct store *store;
+	struct trigram *index;
+	struct backfill *backfill;
+	size_t index_first, index_end;
+
+	/* Budget statistics. */
+	long long total_steps;
+	int aborted;
+
+	/*
+	 * Set by `tail_call` to the environment in which `eval`
+	 * should continue evaluating the value returned by a builtin.
+	 */
+	struct env *tail;
 };
 
+struct env *empty_environment(struct birch *b,
+                              const char *server,
+                              const char *channel);
 struct env *new_environment(struct birch *b,
                             const char *server,
                             const char *channel);
@@ -71,8 +129,14 @@ void value_free(value v);
 value cons(struct env *env, value car, value cdr);
 value acons(struct env *env, value x, value y, value a);
 value make_symbol(struct env *env, const char *s);
+value make_vector(struct env *env, int len);
+value make_ring(struct env *env, int cap);
+void ring_push(struct env *env, value r, value v);
+value ring_ref(struct env *env, value r, int i);
+value make_line(struct env *env, struct line *l);
 value expand(struct env *env, value v);
 value print_value(struct env *env, value v);
+value print_value_limit(struct env *env, value v, size_t limit);
 
 /*
  * A global array mapping each type (as an integer index into the
@@ -87,4 +151,8 @@ value DOT, RPAREN, NIL, TRUE, VEOF;
  * sometimes values actually represent characters. TODO?
  */
 #define TYPE_NAME(X) (X > VAL_ERROR ? (char []){X, 0} : value_name[X])
+
+/* Appended to printed values cut short by `print_value_limit'. */
+#define PRINT_MARKER "..."
+
 #define IS_LIST(X) (type(X) == VAL_NIL || type(X) == VAL_CELL)
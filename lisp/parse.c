@@ -1,4 +1,6 @@
+#include <stdbool.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
 #include <kdg/kdgu.h>
 
@@ -8,6 +10,21 @@
 #include "parse.h"
 #include "eval.h"
 #include "gc.h"
+#include "../util.h"
+
+static struct {
+	uint64_t hash;
+	char *src;
+	size_t len;
+	value expr;
+	size_t rest;            /* Where the unparsed text starts.   */
+	unsigned long used;     /* Tick of the last lookup.          */
+} cache[PARSE_CACHE_SIZE];
+
+static unsigned long tick;
+static int size;
+
+static value parse_list(struct env *env, struct lexer *l);
 
 static value
 parse_expr(struct env *env, struct lexer *l)
@@ -21,12 +38,32 @@ parse_expr(struct env *env, struct lexer *l)
 	 */
 
 	switch ((int)t->type) {
-	case '(':  return parse(env, l);
+	case '(':  return parse_list(env, l);
 	case ')':  return RPAREN;
 	case '.':  return DOT;
 	case '\'': return quote(env, parse_expr(env, l));
 	case '~':  return backtick(env, parse_expr(env, l));
 
+	/* Vector. */
+	case '#': {
+		t = tok(l);
+		if (!t || t->type != '(')
+			return error(env, "expected `(' after `#'");
+
+		value list = parse_list(env, l);
+		if (type(list) == VAL_ERROR) return list;
+
+		int len = 0;
+		for (value i = list; type(i) == VAL_CELL; i = cdr(i))
+			len++;
+
+		value v = make_vector(env, len);
+		for (int i = 0; i < len; i++, list = cdr(list))
+			vector(v).elem[i] = car(list);
+
+		return v;
+	} break;
+
 	case ',': {
 		value v = gc_alloc(env, l->s[l->idx] == '@'
 		                          ? VAL_COMMAT : VAL_COMMA);
@@ -65,7 +102,7 @@ parse_expr(struct env *env, struct lexer *l)
 
 	case TOK_STR: {
 		value v = gc_alloc(env, VAL_STRING);
-		string(v) = kdgu_copy(t->s);
+		string(v) = kdgu_new(KDGU_FMT_UTF8, t->s, t->slen);
 		return v;
 	} break;
 
@@ -78,8 +115,8 @@ parse_expr(struct env *env, struct lexer *l)
 	return error(env, "you shouldn't see this");
 }
 
-value
-parse(struct env *env, struct lexer *l)
+static value
+parse_list(struct env *env, struct lexer *l)
 {
 	value head = NIL, tail = NIL;
 
@@ -89,6 +126,10 @@ parse(struct env *env, struct lexer *l)
 		if (type(o) == VAL_ERROR)
 			return o;
 
+		value err = budget_check(env);
+		if (type(err) == VAL_ERROR)
+			return err;
+
 		if (type(o) == VAL_EOF)
 			return error(env, "unmatched `('");
 
@@ -112,3 +153,119 @@ parse(struct env *env, struct lexer *l)
 		tail = cdr(tail);
 	}
 }
+
+/*
+ * Parses the rest of a list whose `(` has just been read. The tokens
+ * read for a top-level list are freed once it has been parsed.
+ */
+
+value
+parse(struct env *env, struct lexer *l)
+{
+	l->depth++;
+	value v = parse_list(env, l);
+	if (!--l->depth) lexer_reset(l);
+	return v;
+}
+
+/*
+ * Whether any part of `v` can be changed in place. Such forms aren't
+ * cached; one reader's vset would show up in every other reader's form.
+ */
+
+static bool
+mutable(struct env *env, value v)
+{
+	for (;;) {
+		switch (type(v)) {
+		case VAL_VECTOR:
+			return true;
+		case VAL_CELL:
+			if (mutable(env, car(v))) return true;
+			v = cdr(v);
+			break;
+		case VAL_COMMA:
+		case VAL_COMMAT:
+		case VAL_KEYWORD:
+		case VAL_KEYWORDPARAM:
+			v = keyword(v);
+			break;
+		default:
+			return false;
+		}
+	}
+}
+
+/*
+ * Parses the s-expression at the start of `s`, which must begin with
+ * `(`, and sets `rest` to the offset of the text after it. Returns nil
+ * if `s` holds no tokens at all; errors mention the builtin `name`.
+ *
+ * The forms parsed from the last PARSE_CACHE_SIZE distinct strings
+ * are kept, so reading the same text again costs a lookup. Every
+ * reader of the same text gets the same form, so forms holding vectors
+ * are parsed afresh each time.
+ */
+
+value
+parse_string(struct env *env, const char *name, const char *s, size_t *rest)
+{
+	size_t len = strlen(s);
+	uint64_t h = hash(s, len);
+	int victim = 0;
+
+	tick++;
+
+	for (int i = 0; i < size; i++) {
+		if (cache[i].hash == h
+		    && cache[i].len == len
+		    && !memcmp(cache[i].src, s, len)) {
+			cache[i].used = tick;
+			*rest = cache[i].rest;
+			return cache[i].expr;
+		}
+
+		if (cache[i].used < cache[victim].used)
+			victim = i;
+	}
+
+	struct lexer *lexer = new_lexer("*string*", s);
+	struct token *t = tok(lexer);
+
+	if (!t || t->type != '(') {
+		lexer_free(lexer);
+		if (!t) return NIL;
+		return error(env, "builtin `%s' expected `(' to begin"
+		             " s-expression in string contents", name);
+	}
+
+	value expr = parse(env, lexer);
+	*rest = lexer->idx;
+	lexer_free(lexer);
+
+	if (type(expr) == VAL_ERROR || mutable(env, expr)) return expr;
+
+	if (size < PARSE_CACHE_SIZE) victim = size++;
+	else free(cache[victim].src);
+
+	cache[victim].hash = h;
+	cache[victim].src = malloc(len + 1);
+	memcpy(cache[victim].src, s, len + 1);
+	cache[victim].len = len;
+	cache[victim].expr = expr;
+	cache[victim].rest = *rest;
+	cache[victim].used = tick;
+
+	return expr;
+}
+
+/*
+ * Marks the cached forms, which are only reachable from the cache.
+ */
+
+void
+parse_mark(struct env *env)
+{
+	for (int i = 0; i < size; i++)
+		gc_mark(env, cache[i].expr);
+}
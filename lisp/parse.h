@@ -1 +1,10 @@
 value parse(struct env *env, struct lexer *l);
+
+/* Parsed strings remembered by `parse_string`. */
+#define PARSE_CACHE_SIZE 128
+
+value parse_string(struct env *env,
+                   const char *name,
+                   const char *s,
+                   size_t *rest);
+void parse_mark(struct env *env);
@@ -0,0 +1,248 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+#include <kdg/kdgu.h>
+
+#include "lisp.h"
+#include "gc.h"
+#include "error.h"
+#include "regex.h"
+#include "../util.h"
+#include "../irc.h"
+
+/*
+ * The cache is shared by every server thread. It, and the match state
+ * ktre keeps in each program, is only safe because all evaluation
+ * happens under the interpreter lock; see `struct birch`.
+ */
+
+static struct {
+	uint64_t hash;
+	kdgu *pattern;
+	int opt;
+	ktre *re;
+	unsigned long used;     /* Tick of the last lookup.          */
+} cache[REGEX_CACHE_SIZE];
+
+static unsigned long tick;
+static int hits, misses, size;
+
+/*
+ * Returns the compiled program for `pattern` with the options `opt`,
+ * compiling it only if it isn't already cached. When the cache is
+ * full the least recently used program is freed to make room.
+ * Programs that failed to compile are cached too; check `re->err`.
+ */
+
+ktre *
+regex_compile(const kdgu *pattern, int opt)
+{
+	uint64_t h = hash(pattern->s, pattern->len);
+	int victim = 0;
+
+	tick++;
+
+	for (int i = 0; i < size; i++) {
+		if (cache[i].hash == h
+		    && cache[i].opt == opt
+		    && kdgu_cmp(cache[i].pattern, pattern, false, NULL)) {
+			cache[i].used = tick;
+			hits++;
+			return cache[i].re;
+		}
+
+		if (cache[i].used < cache[victim].used)
+			victim = i;
+	}
+
+	misses++;
+
+	if (size < REGEX_CACHE_SIZE) {
+		victim = size++;
+	} else {
+		ktre_free(cache[victim].re);
+		kdgu_free(cache[victim].pattern);
+	}
+
+	cache[victim].hash = h;
+	cache[victim].pattern = kdgu_copy(pattern);
+	cache[victim].opt = opt;
+	cache[victim].re = ktre_compile(cache[victim].pattern, opt);
+	cache[victim].used = tick;
+
+	return cache[victim].re;
+}
+
+/*
+ * Returns the longest run of literal characters that every match of
+ * the regex `s` has to contain, or NULL if no run is long enough. The
+ * caller frees the result. Anything that is hard to reason about
+ * (alternation, groups, classes and non-ASCII text, which may be
+ * case-folded differently) just ends the current run, which is always
+ * safe. The literal should be searched for without regard to case.
+ */
+
+char *
+regex_literal(const char *s, unsigned len)
+{
+	unsigned best = 0, best_len = 0;
+	unsigned start = 0, run = 0;
+	int depth = 0;
+
+	/* Alternation and inline options like (?x) change everything. */
+	for (unsigned i = 0; i < len; i++)
+		if (s[i] == '|'
+		    || (s[i] == '(' && i + 2 < len && s[i + 1] == '?'
+		        && isalpha((unsigned char)s[i + 2])))
+			return NULL;
+
+	for (unsigned i = 0; i <= len; i++) {
+		char c = i < len ? s[i] : 0;
+		bool literal = depth == 0 && i < len
+			&& (unsigned char)c < 0x80
+			&& !strchr("\\.[]()*+?{}^$", c);
+
+		if (literal) {
+			if (!run) start = i;
+			run++;
+			continue;
+		}
+
+		/* These make the preceding character optional. */
+		if ((c == '?' || c == '*' || c == '{') && run) run--;
+		if (run > best_len) best = start, best_len = run;
+		run = 0;
+
+		if (c == '\\') i++;
+		else if (c == '(') depth++;
+		else if (c == ')' && depth) depth--;
+		else if (c == '[')
+			while (i + 1 < len && s[i + 1] != ']') i++;
+		else if (c == '{')
+			while (i + 1 < len && s[i + 1] != '}') i++;
+	}
+
+	if (best_len < MIN_LITERAL) return NULL;
+
+	char *lit = malloc(best_len + 1);
+	memcpy(lit, s + best, best_len);
+	lit[best_len] = 0;
+
+	return lit;
+}
+
+/*
+ * Returns true if `lit` occurs anywhere in the first `len` bytes of
+ * `s`, ignoring ASCII case.
+ */
+
+static bool
+contains(const char *s, size_t len, const char *lit)
+{
+	size_t n = strlen(lit);
+
+	for (size_t i = 0; i + n <= len; i++) {
+		if (tolower((unsigned char)s[i]) != tolower((unsigned char)*lit))
+			continue;
+
+		size_t j = 1;
+		while (j < n && tolower((unsigned char)s[i + j])
+		       == tolower((unsigned char)lit[j]))
+			j++;
+		if (j == n) return true;
+	}
+
+	return false;
+}
+
+/*
+ * Prepares `m` to match the lines said by `nick` (by anyone if it is
+ * nil) whose text matches the regex `pattern` with the mode string
+ * `mode` (which may be nil). Returns an error mentioning the builtin
+ * `name` if the arguments are bad, otherwise nil.
+ */
+
+value
+matcher_init(struct env *env,
+             struct matcher *m,
+             const char *name,
+             value nick,
+             value pattern,
+             value mode)
+{
+	if ((type(nick) && type(nick) != VAL_STRING)
+	    || type(pattern) != VAL_STRING
+	    || (type(mode) && type(mode) != VAL_STRING))
+		return error(env, "builtin `%s' takes a nick or nil,"
+		             " a pattern and a mode string or nil", name);
+
+	int opt = KTRE_UNANCHORED;
+
+	for (unsigned i = 0; type(mode) && i < string(mode)->len; i++) {
+		switch (string(mode)->s[i]) {
+		case 'g': opt |= KTRE_GLOBAL; break;
+		case 'i': opt |= KTRE_INSENSITIVE; break;
+		default:
+			return error(env, "unrecognized"
+			             " mode modifier");
+		}
+	}
+
+	m->re = regex_compile(string(pattern), opt);
+
+	if (m->re->err)
+		return error(env, "%s at index %d in %s",
+		             m->re->err_str,
+		             m->re->i,
+		             tostring(string(pattern)));
+
+	m->literal = regex_literal(string(pattern)->s,
+	                           string(pattern)->len);
+	m->nick = type(nick) ? tostring(string(nick)) : NULL;
+
+	return NIL;
+}
+
+void
+matcher_free(struct matcher *m)
+{
+	free(m->literal);
+	free(m->nick);
+}
+
+/*
+ * Returns false if the `len` bytes of `s` can't contain a match. This
+ * only looks for the literal part of the pattern, so it works on any
+ * text that contains the text being matched, like a raw IRC line.
+ */
+
+bool
+matcher_maybe(struct matcher *m, const char *s, size_t len)
+{
+	return !m->literal || contains(s, len, m->literal);
+}
+
+bool
+matcher_match(struct matcher *m, const struct line *l)
+{
+	if (m->nick && (!l->nick || strcmp(l->nick, m->nick)))
+		return false;
+
+	size_t len;
+	const char *text = line_text(l, &len);
+	kdgu body = { (char *)text, len, KDGU_FMT_UTF8 };
+	int **vec;
+
+	return matcher_maybe(m, text, len) && ktre_exec(m->re, &body, &vec);
+}
+
+void
+regex_statistics(int *h, int *m, int *s)
+{
+	*h = hits;
+	*m = misses;
+	*s = size;
+}
@@ -0,0 +1,37 @@
+/*
+ * A bounded, least-recently-used cache of compiled regular
+ * expressions shared by the regex builtins. The returned programs are
+ * owned by the cache and must not be freed by the caller.
+ */
+
+#define REGEX_CACHE_SIZE 64
+
+/* Literals shorter than this aren't worth filtering on. */
+#define MIN_LITERAL 3
+
+ktre *regex_compile(const kdgu *pattern, int opt);
+void regex_statistics(int *hits, int *misses, int *size);
+char *regex_literal(const char *s, unsigned len);
+
+/*
+ * A matcher selects lines by nick and by a regex over their text.
+ * Lines that can't contain the longest literal in the regex are
+ * rejected without running it. The regex comes from the cache, so no
+ * other regex may be compiled while a matcher is in use.
+ */
+
+struct matcher {
+	ktre *re;
+	char *literal;
+	char *nick;
+};
+
+value matcher_init(struct env *env,
+                   struct matcher *m,
+                   const char *name,
+                   value nick,
+                   value pattern,
+                   value mode);
+void matcher_free(struct matcher *m);
+bool matcher_maybe(struct matcher *m, const char *s, size_t len);
+bool matcher_match(struct matcher *m, const struct line *l);
@@ -0,0 +1,237 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <kdg/kdgu.h>
+
+#include "lisp.h"
+#include "gc.h"
+#include "table.h"
+
+#include "../util.h"
+
+struct entry {
+	value key, val;
+	uint64_t hash;
+	struct entry *next;
+};
+
+/*
+ * While `bucket[1]` is non-NULL the table is being resized: every
+ * bucket of `bucket[0]` below `moved` has already been moved into
+ * it, so keys that hash to those buckets live in `bucket[1]`.
+ */
+
+struct table {
+	struct entry **bucket[2];
+	size_t size[2];
+	size_t moved;
+	size_t count;
+};
+
+/* How many buckets to move per operation during a resize. */
+#define TABLE_STEP 4
+
+struct table *
+table_new(void)
+{
+	struct table *t = malloc(sizeof *t);
+	memset(t, 0, sizeof *t);
+	t->size[0] = 8;
+	t->bucket[0] = calloc(t->size[0], sizeof *t->bucket[0]);
+	return t;
+}
+
+static void
+free_buckets(struct entry **b, size_t size)
+{
+	for (size_t i = 0; i < size; i++) {
+		struct entry *e = b[i];
+
+		while (e) {
+			struct entry *next = e->next;
+			free(e);
+			e = next;
+		}
+	}
+
+	free(b);
+}
+
+void
+table_free(struct table *t)
+{
+	if (!t) return;
+	free_buckets(t->bucket[0], t->size[0]);
+	if (t->bucket[1]) free_buckets(t->bucket[1], t->size[1]);
+	free(t);
+}
+
+/*
+ * Returns true if `key` can be used as a key.
+ */
+
+bool
+table_key(struct env *env, value key)
+{
+	return type(key) == VAL_STRING
+		|| type(key) == VAL_SYMBOL
+		|| type(key) == VAL_INT;
+}
+
+static uint64_t
+hash_key(struct env *env, value key)
+{
+	if (type(key) == VAL_INT)
+		return (uint64_t)integer(key) * 0x9E3779B97F4A7C15ULL;
+
+	/* Keep strings and symbols with the same name apart. */
+	return hash(string(key)->s, string(key)->len) + type(key);
+}
+
+static bool
+same_key(struct env *env, value a, value b)
+{
+	if (type(a) != type(b)) return false;
+	if (type(a) == VAL_INT) return integer(a) == integer(b);
+	return kdgu_cmp(string(a), string(b), false, NULL);
+}
+
+/*
+ * Moves up to `TABLE_STEP` buckets of an ongoing resize, and
+ * finishes the resize once every bucket has been moved.
+ */
+
+static void
+step(struct table *t)
+{
+	if (!t->bucket[1]) return;
+
+	for (int n = 0; n < TABLE_STEP && t->moved < t->size[0]; n++) {
+		struct entry *e = t->bucket[0][t->moved];
+
+		while (e) {
+			struct entry *next = e->next;
+			size_t i = e->hash & (t->size[1] - 1);
+			e->next = t->bucket[1][i];
+			t->bucket[1][i] = e;
+			e = next;
+		}
+
+		t->bucket[0][t->moved++] = NULL;
+	}
+
+	if (t->moved < t->size[0]) return;
+
+	free(t->bucket[0]);
+	t->bucket[0] = t->bucket[1];
+	t->size[0] = t->size[1];
+	t->bucket[1] = NULL;
+	t->size[1] = 0;
+	t->moved = 0;
+}
+
+/*
+ * Returns the link that points to the entry for `key`, or to the
+ * NULL at the end of the chain it would be in.
+ */
+
+static struct entry **
+lookup(struct env *env, struct table *t, value key, uint64_t h)
+{
+	size_t i = h & (t->size[0] - 1);
+	int which = 0;
+
+	if (t->bucket[1] && i < t->moved) {
+		which = 1;
+		i = h & (t->size[1] - 1);
+	}
+
+	struct entry **e = &t->bucket[which][i];
+
+	while (*e && ((*e)->hash != h || !same_key(env, (*e)->key, key)))
+		e = &(*e)->next;
+
+	return e;
+}
+
+bool
+table_get(struct env *env, struct table *t, value key, value *val)
+{
+	step(t);
+
+	struct entry *e = *lookup(env, t, key, hash_key(env, key));
+	if (!e) return false;
+
+	*val = e->val;
+	return true;
+}
+
+void
+table_put(struct env *env, struct table *t, value key, value val)
+{
+	step(t);
+
+	uint64_t h = hash_key(env, key);
+	struct entry **link = lookup(env, t, key, h);
+
+	if (*link) {
+		(*link)->val = val;
+		return;
+	}
+
+	struct entry *e = malloc(sizeof *e);
+	*e = (struct entry){key, val, h, NULL};
+	*link = e;
+	t->count++;
+
+	if (t->bucket[1] || t->count < t->size[0]) return;
+
+	t->size[1] = t->size[0] * 2;
+	t->bucket[1] = calloc(t->size[1], sizeof *t->bucket[1]);
+	t->moved = 0;
+}
+
+bool
+table_del(struct env *env, struct table *t, value key)
+{
+	step(t);
+
+	struct entry **link = lookup(env, t, key, hash_key(env, key));
+	struct entry *e = *link;
+	if (!e) return false;
+
+	*link = e->next;
+	free(e);
+	t->count--;
+
+	return true;
+}
+
+size_t
+table_count(struct table *t)
+{
+	return t->count;
+}
+
+/*
+ * Calls `fn` on every key and value in `t`. `fn` must not modify the
+ * table.
+ */
+
+void
+table_each(struct env *env,
+           struct table *t,
+           void (*fn)(struct env *, value, value, void *),
+           void *data)
+{
+	for (int which = 0; which < 2; which++) {
+		if (!t->bucket[which]) continue;
+
+		for (size_t i = 0; i < t->size[which]; i++)
+			for (struct entry *e = t->bucket[which][i];
+			     e;
+			     e = e->next)
+				fn(env, e->key, e->val, data);
+	}
+}
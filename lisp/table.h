@@ -0,0 +1,17 @@
+/*
+ * Hash tables keyed by strings, symbols and integers. Tables grow by
+ * moving a few buckets into a table of twice the size on every
+ * operation instead of rehashing everything at once.
+ */
+
+struct table *table_new(void);
+void table_free(struct table *t);
+bool table_get(struct env *env, struct table *t, value key, value *val);
+void table_put(struct env *env, struct table *t, value key, value val);
+bool table_del(struct env *env, struct table *t, value key);
+size_t table_count(struct table *t);
+void table_each(struct env *env,
+                struct table *t,
+                void (*fn)(struct env *, value, value, void *),
+                void *data);
+bool table_key(struct env *env, value key);
@@ -6,6 +6,7 @@
 
 #include <curl/curl.h>
 #include <pthread.h>
+#include <signal.h>
 
 #include "lisp/lisp.h"
 
@@ -17,10 +18,26 @@
 int
 main(void)
 {
+	/* SIGHUP is taken by the reload thread; see birch_watch_hangup. */
+	sigset_t set;
+	sigemptyset(&set);
+	sigaddset(&set, SIGHUP);
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
+
 	curl_global_init(CURL_GLOBAL_ALL);
 
-	struct birch *b = birch_new();
-	if (birch_config(b, "birch.lisp")) return 1;
+	/* A heap image saves reading the configuration. */
+	struct birch *b = birch_restore(BIRCH_IMAGE, BIRCH_CONFIG);
+
+	if (b) {
+		if (birch_start(b)) return 1;
+	} else {
+		b = birch_new();
+		if (birch_config(b, BIRCH_CONFIG)) return 1;
+	}
+
+	birch_watch_hangup(b);
+
 	while (getchar() != 'q');
 	curl_global_cleanup();
 
@@ -2,6 +2,7 @@
 #include <string.h>
 #include <stdio.h>
 #include <stdarg.h>
+#include <pthread.h>
 
 #include <sys/types.h>
 #include <sys/socket.h>
@@ -9,10 +10,16 @@
 #include <netdb.h>
 #include <arpa/inet.h>
 
+#include "net.h"
+
 struct net {
 	int sock;
 	struct hostent *server;
 	struct sockaddr_in addr;
+
+	/* The line being sent; `lock' also keeps lines whole. */
+	pthread_mutex_t lock;
+	char out[NET_LINE_MAX + 1];
 };
 
 static int read_char(int sock)
@@ -31,18 +38,30 @@ void net_read(const struct net *n, char *buf)
 	len >= 2 ? (buf[len - 2] = 0) : (buf[len - 1] = 0);
 }
 
-void net_send(const struct net *n, const char *fmt, ...)
+void net_send(struct net *n, const char *fmt, ...)
 {
 	//LOG("Sending: %s", l);
-	/* TODO: Check this return value. */
-	char buf[256];
+	char *buf = net_reserve(n);
 
 	va_list args;
 	va_start(args, fmt);
-	vsnprintf(buf, sizeof buf, fmt, args);
+	int len = vsnprintf(buf, NET_LINE_MAX + 1, fmt, args);
 	va_end(args);
 
-	send(n->sock, buf, strlen(buf), 0);
+	net_commit(n, len < 0 ? 0 : len > NET_LINE_MAX ? NET_LINE_MAX : len);
+}
+
+char *net_reserve(struct net *n)
+{
+	pthread_mutex_lock(&n->lock);
+	return n->out;
+}
+
+void net_commit(struct net *n, size_t len)
+{
+	/* TODO: Check this return value. */
+	if (len) send(n->sock, n->out, len, 0);
+	pthread_mutex_unlock(&n->lock);
 }
 
 struct net *net_open(const char *name, int port)
@@ -60,6 +79,7 @@ struct net *net_open(const char *name, int port)
 	       s->server->h_addr_list[0],
 	       s->server->h_length);
 	s->addr.sin_port = htons(port);
+	pthread_mutex_init(&s->lock, NULL);
 
 	//LOG("Opening network connection to %s:%d...\n", name, port);
 
@@ -1,3 +1,6 @@
+/* The longest line IRC allows, including the trailing \r\n. */
+#define NET_LINE_MAX 512
+
 struct net *net_open(const char *name, int port);
 void net_close(struct net *n);
 
@@ -13,4 +16,14 @@ void net_read(const struct net *n, char *buf);
  * doesn't check for (or add) \r\n at the end of the transmission.
  */
 
-void net_send(const struct net *n, const char *fmt, ...);
+void net_send(struct net *n, const char *fmt, ...);
+
+/*
+ * Lines can also be built straight in the connection's send buffer.
+ * `net_reserve' locks the buffer and returns it; it has room for
+ * NET_LINE_MAX bytes and a terminating null. `net_commit' sends the
+ * first `len' bytes of it, if any, and unlocks it again.
+ */
+
+char *net_reserve(struct net *n);
+void net_commit(struct net *n, size_t len);
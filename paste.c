@@ -0,0 +1,236 @@
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <curl/curl.h>
+
+#include "net.h"
+#include "paste.h"
+
+/* Responses longer than this are not addresses; the upload fails. */
+#define PASTE_REPLY_MAX 4096
+
+/* How long the worker sleeps when nothing wakes it, in milliseconds. */
+#define PASTE_POLL 1000
+
+/*
+ * An upload. Its text is only kept until the worker has escaped it
+ * into the form that is posted.
+ */
+
+struct paste {
+	struct paste *next;
+	struct net *net;
+	char *chan, *url, *text, *form;
+	int room;               /* How long the report may be.       */
+	CURL *curl;
+
+	/* The response, which should be the address of the paste. */
+	char *out;
+	size_t len, cap;
+};
+
+static pthread_once_t worker_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct paste *queue;
+static CURLM *multi;
+
+static size_t
+receive(char *ptr, size_t size, size_t nmemb, void *data)
+{
+	struct paste *p = data;
+	size_t n = size * nmemb;
+
+	if (p->len + n > PASTE_REPLY_MAX) return 0;
+
+	if (p->len + n + 1 > p->cap) {
+		size_t cap = p->cap ? p->cap : 256;
+		while (p->len + n + 1 > cap) cap *= 2;
+		char *out = realloc(p->out, cap);
+		if (!out) return 0;
+		p->out = out;
+		p->cap = cap;
+	}
+
+	memcpy(p->out + p->len, ptr, n);
+	p->len += n;
+	p->out[p->len] = 0;
+
+	return n;
+}
+
+static void
+free_paste(struct paste *p)
+{
+	if (p->curl) curl_easy_cleanup(p->curl);
+	free(p->chan);
+	free(p->url);
+	free(p->text);
+	free(p->form);
+	free(p->out);
+	free(p);
+}
+
+/*
+ * Sends `msg` to the channel, cut short if needed so that it fits in
+ * the room the paste was submitted with.
+ */
+
+static void
+report(struct paste *p, const char *msg)
+{
+	if (p->room > 0)
+		net_send(p->net, "PRIVMSG %s :%.*s\r\n",
+		         p->chan, p->room, msg);
+
+	free_paste(p);
+}
+
+/*
+ * Adds an upload to the multi handle. The form is in the shape ix.io
+ * expects, which most paste sites that take plain posts accept too.
+ */
+
+static void
+start(struct paste *p)
+{
+	if (!(p->curl = curl_easy_init())) {
+		report(p, "Paste failed.");
+		return;
+	}
+
+	char *data = curl_easy_escape(p->curl, p->text, strlen(p->text));
+	if (!data) {
+		report(p, "Paste failed.");
+		return;
+	}
+
+	p->form = malloc(strlen(data) + 5);
+	if (p->form) sprintf(p->form, "f:1=%s", data);
+	curl_free(data);
+	free(p->text);
+	p->text = NULL;
+
+	if (!p->form) {
+		report(p, "Paste failed.");
+		return;
+	}
+
+	curl_easy_setopt(p->curl, CURLOPT_URL, p->url);
+	curl_easy_setopt(p->curl, CURLOPT_POSTFIELDS, p->form);
+	curl_easy_setopt(p->curl, CURLOPT_WRITEFUNCTION, receive);
+	curl_easy_setopt(p->curl, CURLOPT_WRITEDATA, p);
+	curl_easy_setopt(p->curl, CURLOPT_PRIVATE, p);
+	curl_easy_setopt(p->curl, CURLOPT_NOSIGNAL, 1L);
+	curl_easy_setopt(p->curl, CURLOPT_TIMEOUT, 30L);
+
+	curl_multi_add_handle(multi, p->curl);
+}
+
+/*
+ * Sends the first line of the response to the channel if the upload
+ * succeeded.
+ */
+
+static void
+finish(struct paste *p, CURLcode res)
+{
+	long code = 0;
+	curl_easy_getinfo(p->curl, CURLINFO_RESPONSE_CODE, &code);
+	curl_multi_remove_handle(multi, p->curl);
+
+	if (res != CURLE_OK || code < 200 || code >= 300 || !p->len) {
+		report(p, "Paste failed.");
+		return;
+	}
+
+	p->out[strcspn(p->out, "\r\n")] = 0;
+	report(p, *p->out ? p->out : "Paste failed.");
+}
+
+static void *
+worker_main(void *arg)
+{
+	(void)arg;
+
+	while (true) {
+		pthread_mutex_lock(&queue_lock);
+		struct paste *p = queue;
+		queue = NULL;
+		pthread_mutex_unlock(&queue_lock);
+
+		while (p) {
+			struct paste *next = p->next;
+			start(p);
+			p = next;
+		}
+
+		int running, left;
+		curl_multi_perform(multi, &running);
+
+		CURLMsg *msg;
+		while ((msg = curl_multi_info_read(multi, &left))) {
+			if (msg->msg != CURLMSG_DONE) continue;
+			curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, &p);
+			finish(p, msg->data.result);
+		}
+
+		curl_multi_poll(multi, NULL, 0, PASTE_POLL, NULL);
+	}
+
+	return NULL;
+}
+
+static void
+start_worker(void)
+{
+	multi = curl_multi_init();
+
+	pthread_t thread;
+	pthread_create(&thread, NULL, worker_main, NULL);
+	pthread_detach(thread);
+}
+
+/*
+ * Uploads `text` to the paste site at `url` and reports the result to
+ * `chan` on `net`, in at most `room` bytes of text. The room has to
+ * leave space for the prefix the server puts on the line when it
+ * relays it; the line sent to the server is never longer than
+ * NET_LINE_MAX either way.
+ */
+
+void
+paste_submit(struct net *net,
+             const char *chan,
+             const char *url,
+             const char *text,
+             int room)
+{
+	struct paste *p = calloc(1, sizeof *p);
+	if (!p) return;
+
+	int most = NET_LINE_MAX - (int)strlen("PRIVMSG  :\r\n")
+		- (int)strlen(chan);
+
+	p->room = room < most ? room : most;
+	p->net = net;
+	p->chan = strdup(chan);
+	p->url = strdup(url);
+	p->text = strdup(text);
+
+	if (!p->chan || !p->url || !p->text) {
+		free_paste(p);
+		return;
+	}
+
+	pthread_once(&worker_once, start_worker);
+
+	pthread_mutex_lock(&queue_lock);
+	p->next = queue;
+	queue = p;
+	pthread_mutex_unlock(&queue_lock);
+
+	curl_multi_wakeup(multi);
+}
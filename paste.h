@@ -0,0 +1,13 @@
+/*
+ * Pastes. Uploads are handed to a worker thread that runs all of them
+ * on one curl multi handle, so nothing waits for the paste site and
+ * connections to it are kept alive between pastes. When an upload
+ * finishes, the worker sends the address of the paste (or a complaint)
+ * to the channel itself.
+ */
+
+void paste_submit(struct net *net,
+                  const char *chan,
+                  const char *url,
+                  const char *text,
+                  int room);
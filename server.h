@@ -1,5 +1,6 @@
 struct server {
 	char *name;
+	char *nick, *user;
 	struct net *net;
 	pthread_t thread;
 };
@@ -0,0 +1,1195 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <zlib.h>
+
+#include "list.h"
+#include "store.h"
+
+/* Records are read from the segments a page at a time. */
+#define STORE_PAGE 65536
+
+/* Sealed segments are compressed in blocks of this many bytes. */
+#define STORE_BLOCK 65536
+
+/* How often the compactor looks for work when nothing wakes it. */
+#define COMPACT_INTERVAL 60
+
+/* How often STORE_SYNC_PERIODIC flushes to disk, in milliseconds. */
+#define SYNC_PERIOD 1000
+
+/*
+ * A segment holds the records in a range of the logical byte stream
+ * that the index refers to, starting at `base`. Only the newest
+ * segment is appended to. Once a newer segment is started the old one
+ * is sealed, and the compactor later rewrites it as independently
+ * compressed blocks:
+ *
+ *     "BSZ1" num_block last (block offset, clen, ulen)... data...
+ */
+
+struct block {
+	uint64_t offset;
+	uint32_t clen, ulen;
+};
+
+struct segment {
+	uint64_t base, size;
+	int64_t last;           /* The time of its newest record.     */
+	int fd;
+	bool compressed;
+	uint32_t num_block;
+	struct block *block;
+};
+
+/*
+ * A record waiting for the writer. Appends push records onto a
+ * lock-free stack, and the writer takes the whole stack at once and
+ * reverses it, so appending never waits for the disk.
+ */
+
+struct record {
+	struct record *next;
+	struct store *store;
+	int64_t time;
+	long long queued;       /* When it was appended.              */
+	size_t len;
+	char text[];
+};
+
+struct mapping {
+	void *addr;
+	size_t len;
+};
+
+struct store {
+	char *dir;
+
+	/*
+	 * Held by the writer only while it publishes what it has
+	 * written or adds a segment, never across a write or an fsync,
+	 * by readers while they read from a segment, and by the
+	 * compactor only while it swaps segments in or out.
+	 */
+	pthread_mutex_t lock;
+
+	int idx;
+
+	/*
+	 * The mapped part of the index and the number of entries that
+	 * have been written. Readers don't take the lock, so the
+	 * writer publishes `count` only once the entries are mapped
+	 * and never unmaps a mapping that a reader might be using.
+	 */
+	struct store_entry *_Atomic index;
+	size_t mapped;
+	_Atomic size_t count;
+	struct mapping *retired;
+	size_t num_retired;
+
+	/* Whether anything has been written since the last fsync. */
+	bool dirty;
+
+	/* The first record that hasn't been dropped. */
+	_Atomic size_t first;
+
+	/*
+	 * The logical end of the last record, and the start and file
+	 * of the active segment. Only the writer changes these, so it
+	 * reads them without the lock.
+	 */
+	uint64_t end, active_base;
+	int active;
+
+	struct segment *seg;
+	size_t num_seg;
+
+	uint64_t segment_size, max_bytes;
+	int64_t max_age;
+
+	/* The last page read by `store_read`. */
+	struct store_page page;
+};
+
+static struct list *stores;
+static pthread_mutex_t stores_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t compact_wake = PTHREAD_COND_INITIALIZER;
+static pthread_once_t threads_once = PTHREAD_ONCE_INIT;
+
+static struct record *_Atomic queue;
+static _Atomic size_t pending;
+static _Atomic int sync_mode = STORE_SYNC_PERIODIC;
+static _Atomic int commit_interval = 50;
+
+/* What the writer has done, for `store_writer_statistics`. */
+static pthread_mutex_t writer_lock = PTHREAD_MUTEX_INITIALIZER;
+static long long writer_lag, writer_max_lag;
+static uint64_t writer_bytes, writer_rate, writer_syncs;
+
+static long long
+now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static char *
+segment_path(struct store *s, uint64_t base, const char *ext)
+{
+	char *p = malloc(strlen(s->dir) + 32);
+	sprintf(p, "%s/%020" PRIu64 "%s", s->dir, base, ext);
+	return p;
+}
+
+/*
+ * Makes sure that the first `count` entries of the index are mapped.
+ * The old mapping is kept until the store is closed, since readers
+ * may still be looking at it.
+ */
+
+static int
+map_index(struct store *s, size_t count)
+{
+	if (s->mapped >= count) return 0;
+
+	/* Leave room so that appends don't remap every time. */
+	size_t n = count * 2 + 1024;
+	struct store_entry *index = mmap(NULL,
+	                                 n * sizeof *index,
+	                                 PROT_READ,
+	                                 MAP_SHARED,
+	                                 s->idx,
+	                                 0);
+
+	if (index == MAP_FAILED) return -1;
+
+	if (s->index) {
+		s->retired = realloc(s->retired,
+		                     (s->num_retired + 1)
+		                     * sizeof *s->retired);
+		s->retired[s->num_retired++] = (struct mapping){
+			s->index, s->mapped * sizeof *index
+		};
+	}
+
+	s->index = index;
+	s->mapped = n;
+	return 0;
+}
+
+/*
+ * Returns the number of records that start before the logical offset
+ * `off`.
+ */
+
+static size_t
+records_before(struct store *s, uint64_t off)
+{
+	size_t lo = 0, hi = s->count;
+
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		if (s->index[mid].offset < off) lo = mid + 1;
+		else hi = mid;
+	}
+
+	return lo;
+}
+
+static int
+read_all(int fd, void *buf, size_t len, off_t off)
+{
+	while (len) {
+		ssize_t n = pread(fd, buf, len, off);
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0) return -1;
+		buf = (char *)buf + n, len -= n, off += n;
+	}
+
+	return 0;
+}
+
+static int
+write_all(int fd, const void *buf, size_t len, off_t off)
+{
+	while (len) {
+		ssize_t n = pwrite(fd, buf, len, off);
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0) return -1;
+		buf = (const char *)buf + n, len -= n, off += n;
+	}
+
+	return 0;
+}
+
+static int
+load_compressed(struct segment *g)
+{
+	char magic[4];
+	uint32_t n;
+
+	if (read_all(g->fd, magic, 4, 0)
+	    || memcmp(magic, "BSZ1", 4)
+	    || read_all(g->fd, &n, sizeof n, 4)
+	    || read_all(g->fd, &g->last, sizeof g->last, 8))
+		return -1;
+
+	g->num_block = n;
+	g->block = malloc((n + 1) * sizeof *g->block);
+
+	if (read_all(g->fd, g->block, n * sizeof *g->block, 16))
+		return -1;
+
+	g->size = 0;
+	for (uint32_t i = 0; i < n; i++)
+		g->size += g->block[i].ulen;
+
+	g->compressed = true;
+	return 0;
+}
+
+static int
+compare_segments(const void *a, const void *b)
+{
+	const struct segment *x = a, *y = b;
+	return x->base < y->base ? -1 : x->base > y->base;
+}
+
+static int
+open_segment(struct store *s, uint64_t base)
+{
+	char *p = segment_path(s, base, ".log");
+	int fd = open(p, O_RDWR | O_CREAT, 0644);
+	free(p);
+	return fd;
+}
+
+static void
+push_segment(struct store *s, uint64_t base, int fd)
+{
+	s->seg = realloc(s->seg, (s->num_seg + 1) * sizeof *s->seg);
+	s->seg[s->num_seg++] = (struct segment){
+		base, 0, 0, fd, false, 0, NULL
+	};
+}
+
+static int
+add_segment(struct store *s, uint64_t base)
+{
+	int fd = open_segment(s, base);
+	if (fd < 0) return -1;
+	push_segment(s, base, fd);
+	return 0;
+}
+
+static void *compact_main(void *arg);
+static void *writer_main(void *arg);
+
+static void
+start_threads(void)
+{
+	pthread_t thread;
+	pthread_create(&thread, NULL, compact_main, NULL);
+	pthread_detach(thread);
+	pthread_create(&thread, NULL, writer_main, NULL);
+	pthread_detach(thread);
+}
+
+/*
+ * Opens the store in the directory `dir`, creating it if it doesn't
+ * exist. A record that was only partly written when the bot last
+ * stopped is discarded.
+ */
+
+struct store *
+store_open(const char *dir)
+{
+	struct store *s = calloc(1, sizeof *s);
+	s->dir = strdup(dir);
+	s->idx = -1;
+	pthread_mutex_init(&s->lock, NULL);
+
+	mkdir(dir, 0755);
+
+	char *idx = malloc(strlen(dir) + 7);
+	sprintf(idx, "%s/index", dir);
+	s->idx = open(idx, O_RDWR | O_CREAT, 0644);
+	free(idx);
+
+	DIR *d = opendir(dir);
+
+	if (s->idx < 0 || !d) {
+		if (d) closedir(d);
+		store_close(s);
+		return NULL;
+	}
+
+	struct stat st;
+	fstat(s->idx, &st);
+	s->count = st.st_size / sizeof *s->index;
+
+	if (map_index(s, s->count)) {
+		closedir(d);
+		store_close(s);
+		return NULL;
+	}
+
+	/*
+	 * Find the segments. A compressed segment replaces the log it
+	 * was made from, which might not have been removed yet.
+	 */
+
+	for (struct dirent *e; (e = readdir(d));) {
+		uint64_t base;
+		char ext[8];
+
+		if (sscanf(e->d_name, "%20" SCNu64 ".%3s", &base, ext) != 2
+		    || (strcmp(ext, "log") && strcmp(ext, "z")))
+			continue;
+
+		bool z = !strcmp(ext, "z");
+		char *p = segment_path(s, base, z ? ".z" : ".log");
+		struct segment g = { base, 0, 0, open(p, O_RDWR),
+		                     false, 0, NULL };
+		free(p);
+
+		if (g.fd < 0) continue;
+
+		if (z ? load_compressed(&g)
+		    : (fstat(g.fd, &st), g.size = st.st_size, 0)) {
+			close(g.fd), free(g.block);
+			continue;
+		}
+
+		size_t i = 0;
+		while (i < s->num_seg && s->seg[i].base != base) i++;
+
+		if (i < s->num_seg) {
+			/* Keep whichever one is compressed. */
+			struct segment *old = &s->seg[i];
+			if (old->compressed) {
+				close(g.fd), free(g.block);
+				continue;
+			}
+			close(old->fd);
+			*old = g;
+			continue;
+		}
+
+		s->seg = realloc(s->seg, (s->num_seg + 1) * sizeof *s->seg);
+		s->seg[s->num_seg++] = g;
+	}
+
+	closedir(d);
+	if (s->num_seg)
+		qsort(s->seg, s->num_seg, sizeof *s->seg, compare_segments);
+
+	/* Remove any logs that were compressed before we stopped. */
+	for (size_t i = 0; i < s->num_seg; i++) {
+		if (!s->seg[i].compressed) continue;
+		char *p = segment_path(s, s->seg[i].base, ".log");
+		unlink(p);
+		free(p);
+	}
+
+	/*
+	 * The record is written before its index entry, so the index
+	 * can only run past the data if a segment was damaged.
+	 */
+
+	uint64_t end = s->num_seg
+		? s->seg[s->num_seg - 1].base + s->seg[s->num_seg - 1].size
+		: 0;
+
+	while (s->count
+	       && s->index[s->count - 1].offset
+	          + s->index[s->count - 1].len + 1 > end)
+		s->count--;
+
+	if (s->count)
+		s->end = s->index[s->count - 1].offset
+			+ s->index[s->count - 1].len + 1;
+
+	if (s->num_seg)
+		s->first = records_before(s, s->seg[0].base);
+	else
+		s->first = s->count;
+
+	for (size_t i = 0; i < s->num_seg; i++) {
+		struct segment *g = &s->seg[i];
+		if (g->compressed) continue;
+		size_t last = records_before(s, g->base + g->size);
+		if (last) g->last = s->index[last - 1].time;
+	}
+
+	/* Appends always go to an uncompressed segment. */
+	if (!s->num_seg || s->seg[s->num_seg - 1].compressed) {
+		if (add_segment(s, s->end)) {
+			store_close(s);
+			return NULL;
+		}
+	}
+
+	struct segment *active = &s->seg[s->num_seg - 1];
+	if (s->end < active->base) s->end = active->base;
+	active->size = s->end - active->base;
+	s->active_base = active->base;
+	s->active = active->fd;
+
+	if (ftruncate(s->idx, s->count * sizeof *s->index)
+	    || ftruncate(active->fd, active->size)) {
+		store_close(s);
+		return NULL;
+	}
+
+
+	pthread_once(&threads_once, start_threads);
+	pthread_mutex_lock(&stores_lock);
+	list_add(&stores, s);
+	pthread_mutex_unlock(&stores_lock);
+
+	return s;
+}
+
+/*
+ * Closes a store that isn't registered with the compactor; stores
+ * that opened successfully live as long as the bot.
+ */
+
+void
+store_close(struct store *s)
+{
+	if (!s) return;
+	if (s->index) munmap(s->index, s->mapped * sizeof *s->index);
+	if (s->idx >= 0) close(s->idx);
+
+	for (size_t i = 0; i < s->num_retired; i++)
+		munmap(s->retired[i].addr, s->retired[i].len);
+
+	for (size_t i = 0; i < s->num_seg; i++) {
+		close(s->seg[i].fd);
+		free(s->seg[i].block);
+	}
+
+	pthread_mutex_destroy(&s->lock);
+	free(s->retired);
+	free(s->seg);
+	free(s->page.data);
+	free(s->dir);
+	free(s);
+}
+
+/*
+ * Sets when the active segment is sealed (once it holds
+ * `segment_size` bytes) and when sealed segments are dropped (once
+ * their newest record is `max_age` seconds old, or oldest first while
+ * the store takes more than `max_bytes` on disk). Zero means never.
+ */
+
+void
+store_configure(struct store *s,
+                uint64_t segment_size,
+                int64_t max_age,
+                uint64_t max_bytes)
+{
+	pthread_mutex_lock(&s->lock);
+	s->segment_size = segment_size;
+	s->max_age = max_age;
+	s->max_bytes = max_bytes;
+	pthread_mutex_unlock(&s->lock);
+}
+
+/*
+ * Sets how the writer makes records durable: STORE_SYNC_NONE leaves
+ * it to the kernel, STORE_SYNC_PERIODIC calls fsync about once a
+ * second and STORE_SYNC_GROUP after every batch. The writer collects
+ * a batch every `interval` milliseconds. This applies to all stores.
+ */
+
+void
+store_durability(enum store_sync mode, int interval)
+{
+	sync_mode = mode;
+	commit_interval = interval > 0 ? interval : 1;
+}
+
+/*
+ * Queues a record of `len` bytes of `text` logged at `time` to be
+ * appended. It becomes visible to `store_count` and `store_read` once
+ * the writer has written it, normally within one commit interval.
+ * Returns zero on success.
+ */
+
+int
+store_append(struct store *s,
+             int64_t time,
+             const char *text,
+             size_t len)
+{
+	struct record *r = malloc(sizeof *r + len);
+	if (!r) return -1;
+
+	r->store = s;
+	r->time = time;
+	r->queued = now_ns();
+	r->len = len;
+	memcpy(r->text, text, len);
+
+	pending++;
+
+	r->next = queue;
+	while (!atomic_compare_exchange_weak(&queue, &r->next, r));
+
+	return 0;
+}
+
+size_t
+store_count(struct store *s)
+{
+	return s->count;
+}
+
+/*
+ * Returns the number of the oldest record that hasn't been dropped.
+ */
+
+size_t
+store_first(struct store *s)
+{
+	return s->first;
+}
+
+/*
+ * Returns the index entry of the `i`th record, counting from the
+ * oldest.
+ */
+
+const struct store_entry *
+store_entry(struct store *s, size_t i)
+{
+	if (i >= s->count) return NULL;
+	return &s->index[i];
+}
+
+static struct segment *
+find_segment(struct store *s, uint64_t off)
+{
+	size_t lo = 0, hi = s->num_seg;
+
+	while (hi - lo > 1) {
+		size_t mid = lo + (hi - lo) / 2;
+		if (s->seg[mid].base <= off) lo = mid;
+		else hi = mid;
+	}
+
+	if (!s->num_seg || off < s->seg[lo].base) return NULL;
+	return &s->seg[lo];
+}
+
+/*
+ * Reads the page holding the `len` bytes at the logical offset `off`
+ * of the segment `g` into `p`, but nothing past `limit`, where the
+ * writer may be busy. A compressed segment is decompressed only a
+ * block at a time.
+ */
+
+static int
+read_page(struct segment *g,
+          uint64_t off,
+          size_t len,
+          uint64_t limit,
+          struct store_page *p)
+{
+	if (g->compressed) {
+		uint32_t b = (off - g->base) / STORE_BLOCK;
+		uint32_t e = (off + len - 1 - g->base) / STORE_BLOCK;
+		if (e >= g->num_block) return -1;
+
+		p->data = realloc(p->data, (e - b + 1) * STORE_BLOCK);
+		p->offset = g->base + (uint64_t)b * STORE_BLOCK;
+		p->len = 0;
+
+		for (; b <= e; b++) {
+			char *in = malloc(g->block[b].clen);
+			uLongf n = STORE_BLOCK;
+
+			int err = read_all(g->fd, in, g->block[b].clen,
+			                   g->block[b].offset)
+				|| uncompress((Bytef *)p->data + p->len,
+				              &n, (Bytef *)in,
+				              g->block[b].clen) != Z_OK;
+			free(in);
+
+			if (err) return p->len = 0, -1;
+			p->len += n;
+		}
+
+		return 0;
+	}
+
+	size_t size = STORE_PAGE;
+	uint64_t start = off;
+
+	/* Centre the page on the record to suit both directions. */
+	if (len > STORE_PAGE / 2)
+		size = len > STORE_PAGE ? len : STORE_PAGE;
+	else
+		start = start - g->base > STORE_PAGE / 2
+			? start - STORE_PAGE / 2 : g->base;
+
+	p->data = realloc(p->data, size);
+	ssize_t n = pread(g->fd, p->data, size, start - g->base);
+	p->offset = start;
+	p->len = n > 0 ? n : 0;
+
+	if (start + p->len > limit)
+		p->len = limit > start ? limit - start : 0;
+
+	return 0;
+}
+
+/*
+ * Returns the text of the `i`th record and sets `len` to its length,
+ * or returns NULL if it has been dropped. The text is read through
+ * the page `p` and stays valid until the next read through it.
+ * Records are read a page at a time, so walking through neighbouring
+ * records is cheap in either direction. Threads may read the same
+ * store at once as long as each has a page of its own.
+ */
+
+const char *
+store_read_page(struct store *s,
+                size_t i,
+                size_t *len,
+                struct store_page *p)
+{
+	size_t count = s->count;
+	if (i >= count || i < s->first) return NULL;
+
+	struct store_entry *index = s->index;
+	const struct store_entry *e = &index[i];
+	uint64_t limit = index[count - 1].offset + index[count - 1].len + 1;
+	*len = e->len;
+
+	if (e->offset >= p->offset
+	    && e->offset + e->len <= p->offset + p->len)
+		return p->data + (e->offset - p->offset);
+
+	pthread_mutex_lock(&s->lock);
+
+	struct segment *g = find_segment(s, e->offset);
+	int err = !g || read_page(g, e->offset, e->len, limit, p);
+
+	pthread_mutex_unlock(&s->lock);
+
+	if (err || e->offset + e->len > p->offset + p->len)
+		return NULL;
+
+	return p->data + (e->offset - p->offset);
+}
+
+/*
+ * Reads the `i`th record through the store's own page; see
+ * `store_read_page`. Only the thread that owns the store may use it.
+ */
+
+const char *
+store_read(struct store *s, size_t i, size_t *len)
+{
+	return store_read_page(s, i, len, &s->page);
+}
+
+/*
+ * Returns the number of records logged before `time`, which is the
+ * index of the first record logged at or after it.
+ */
+
+size_t
+store_seek(struct store *s, int64_t time)
+{
+	size_t lo = s->first, hi = s->count;
+	struct store_entry *index = s->index;
+
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		if (index[mid].time < time) lo = mid + 1;
+		else hi = mid;
+	}
+
+	return lo;
+}
+
+/*
+ * Writes the sealed segment that starts at `base` (of `size` bytes,
+ * read from `fd`) as a compressed segment. The new file only takes
+ * the name the store looks for once it is complete.
+ */
+
+static int
+compress_segment(struct store *s,
+                 uint64_t base,
+                 uint64_t size,
+                 int64_t last,
+                 int fd)
+{
+	uint32_t n = (size + STORE_BLOCK - 1) / STORE_BLOCK;
+	struct block *block = calloc(n + 1, sizeof *block);
+	char *in = malloc(STORE_BLOCK);
+	uLong bound = compressBound(STORE_BLOCK);
+	char *out = malloc(bound);
+
+	char *tmp = segment_path(s, base, ".z.tmp");
+	char *path = segment_path(s, base, ".z");
+	int zfd = open(tmp, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	int err = zfd < 0;
+
+	uint64_t at = 16 + (uint64_t)n * sizeof *block;
+
+	for (uint32_t i = 0; !err && i < n; i++) {
+		uint32_t ulen = size - (uint64_t)i * STORE_BLOCK;
+		if (ulen > STORE_BLOCK) ulen = STORE_BLOCK;
+		uLongf clen = bound;
+
+		err = read_all(fd, in, ulen, (uint64_t)i * STORE_BLOCK)
+			|| compress2((Bytef *)out, &clen,
+			             (Bytef *)in, ulen, 6) != Z_OK
+			|| write_all(zfd, out, clen, at);
+
+		block[i] = (struct block){ at, clen, ulen };
+		at += clen;
+	}
+
+	if (!err)
+		err = write_all(zfd, "BSZ1", 4, 0)
+			|| write_all(zfd, &n, sizeof n, 4)
+			|| write_all(zfd, &last, sizeof last, 8)
+			|| write_all(zfd, block, n * sizeof *block, 16)
+			|| fsync(zfd)
+			|| rename(tmp, path);
+
+	if (zfd >= 0) close(zfd);
+	if (err) unlink(tmp);
+
+	free(block), free(in), free(out);
+	free(tmp), free(path);
+
+	return err ? -1 : 0;
+}
+
+/*
+ * Compresses the sealed segments of `s` and drops the ones that are
+ * past retention. The store is only locked to find the work and to
+ * swap the results in, never while compressing.
+ */
+
+static void
+compact(struct store *s)
+{
+	for (;;) {
+		pthread_mutex_lock(&s->lock);
+
+		struct segment work = { 0 };
+		bool found = false;
+
+		for (size_t i = 0; i + 1 < s->num_seg; i++) {
+			if (s->seg[i].compressed) continue;
+			work = s->seg[i];
+			work.fd = dup(work.fd);
+			found = true;
+			break;
+		}
+
+		pthread_mutex_unlock(&s->lock);
+
+		if (!found || work.fd < 0) break;
+
+		int err = compress_segment(s, work.base, work.size,
+		                           work.last, work.fd);
+		close(work.fd);
+		if (err) break;
+
+		char *p = segment_path(s, work.base, ".z");
+		struct segment g = { work.base, 0, 0, open(p, O_RDWR),
+		                     false, 0, NULL };
+		free(p);
+
+		if (g.fd < 0 || load_compressed(&g)) {
+			if (g.fd >= 0) close(g.fd);
+			free(g.block);
+			break;
+		}
+
+		pthread_mutex_lock(&s->lock);
+		struct segment *old = find_segment(s, work.base);
+		int fd = old->fd;
+		*old = g;
+		pthread_mutex_unlock(&s->lock);
+
+		close(fd);
+		p = segment_path(s, work.base, ".log");
+		unlink(p);
+		free(p);
+	}
+
+	/* Retention never touches the active segment. */
+	int64_t now = time(NULL);
+
+	for (;;) {
+		pthread_mutex_lock(&s->lock);
+
+		uint64_t total = 0;
+		for (size_t i = 0; i < s->num_seg; i++) {
+			struct segment *g = &s->seg[i];
+			total += g->compressed && g->num_block
+				? g->block[g->num_block - 1].offset
+				  + g->block[g->num_block - 1].clen
+				: g->size;
+		}
+
+		struct segment *g = &s->seg[0];
+		bool drop = s->num_seg > 1
+			&& ((s->max_age && g->last < now - s->max_age)
+			    || (s->max_bytes && total > s->max_bytes));
+		struct segment old = *g;
+
+		if (drop) {
+			memmove(s->seg, s->seg + 1,
+			        --s->num_seg * sizeof *s->seg);
+			s->first = records_before(s, s->seg[0].base);
+		}
+
+		pthread_mutex_unlock(&s->lock);
+
+		if (!drop) break;
+
+		close(old.fd);
+		free(old.block);
+
+		char *p = segment_path(s, old.base,
+		                       old.compressed ? ".z" : ".log");
+		unlink(p);
+		free(p);
+	}
+}
+
+/*
+ * Returns a copy of the list of open stores, so that stores can be
+ * opened while the caller works through it.
+ */
+
+static struct store **
+all_stores(size_t *n)
+{
+	pthread_mutex_lock(&stores_lock);
+
+	*n = 0;
+	for (struct list *l = stores; l; l = l->next) (*n)++;
+
+	struct store **work = malloc((*n + 1) * sizeof *work);
+	*n = 0;
+	for (struct list *l = stores; l; l = l->next)
+		work[(*n)++] = l->data;
+
+	pthread_mutex_unlock(&stores_lock);
+
+	return work;
+}
+
+static void *
+compact_main(void *arg)
+{
+	(void)arg;
+
+	for (;;) {
+		struct timespec ts;
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec += COMPACT_INTERVAL;
+
+		pthread_mutex_lock(&stores_lock);
+		pthread_cond_timedwait(&compact_wake, &stores_lock, &ts);
+		pthread_mutex_unlock(&stores_lock);
+
+		size_t n;
+		struct store **work = all_stores(&n);
+
+		for (size_t i = 0; i < n; i++) compact(work[i]);
+		free(work);
+	}
+
+	return NULL;
+}
+
+/*
+ * Writes `len` bytes of records in `buf` to the active segment of `s`
+ * and their `n` index entries after it, then makes them visible to
+ * readers. Only the writer calls this, and it's the only one to touch
+ * the active segment and the end of the index, so the lock is only
+ * taken to publish the new size.
+ */
+
+static int
+commit(struct store *s,
+       const char *buf,
+       size_t len,
+       const struct store_entry *e,
+       size_t n)
+{
+	if (!n) return 0;
+
+	size_t count = s->count;
+
+	if (write_all(s->active, buf, len, s->end - s->active_base)
+	    || write_all(s->idx, e, n * sizeof *e, count * sizeof *e)
+	    || map_index(s, count + n))
+		return -1;
+
+	pthread_mutex_lock(&s->lock);
+	struct segment *g = &s->seg[s->num_seg - 1];
+	g->size += len;
+	g->last = e[n - 1].time;
+	s->end += len;
+	s->dirty = true;
+	s->count = count + n;
+	pthread_mutex_unlock(&s->lock);
+
+	return 0;
+}
+
+/*
+ * Seals the active segment of `s` and starts a new one. The old one
+ * is synced first, while it's still active and so can't be closed by
+ * the compactor; readers only wait for the new segment to be added.
+ */
+
+static int
+seal(struct store *s)
+{
+	/* Sealed segments are always durable. */
+	if (sync_mode != STORE_SYNC_NONE) fsync(s->active);
+
+	int fd = open_segment(s, s->end);
+	if (fd < 0) return -1;
+
+	pthread_mutex_lock(&s->lock);
+	push_segment(s, s->end, fd);
+	pthread_mutex_unlock(&s->lock);
+
+	s->active_base = s->end;
+	s->active = fd;
+
+	pthread_cond_signal(&compact_wake);
+	return 0;
+}
+
+/*
+ * Writes the records `r` of the store `s`, oldest first, with one
+ * write to the segment and one to the index for each segment they
+ * land in. Returns the number of bytes written.
+ */
+
+static uint64_t
+write_records(struct store *s, struct record *r)
+{
+	char *buf = NULL;
+	struct store_entry *e = NULL;
+	size_t used = 0, n = 0, cap = 0, num = 0;
+	uint64_t written = 0;
+	int err = 0;
+
+	for (struct record *p = r; p; p = p->next) {
+		cap += p->len + 1;
+		num++;
+	}
+
+	buf = malloc(cap);
+	e = malloc(num * sizeof *e);
+
+	pthread_mutex_lock(&s->lock);
+	uint64_t limit = s->segment_size;
+	pthread_mutex_unlock(&s->lock);
+
+	while (r && !err) {
+		uint64_t size = s->end - s->active_base;
+
+		if (limit && size + used
+		    && size + used + r->len + 1 > limit) {
+			err = commit(s, buf, used, e, n);
+			if (err) break;
+
+			written += used;
+			used = n = 0;
+			err = seal(s);
+			continue;
+		}
+
+		e[n++] = (struct store_entry){
+			s->end + used, r->time, r->len, 0
+		};
+
+		memcpy(buf + used, r->text, r->len);
+		buf[used + r->len] = '\n';
+		used += r->len + 1;
+		r = r->next;
+	}
+
+	if (!err) err = commit(s, buf, used, e, n);
+	if (!err) written += used;
+
+	if (err)
+		fprintf(stderr, "couldn't write to the store %s: %s\n",
+		        s->dir, strerror(errno));
+
+	free(buf), free(e);
+
+	return written;
+}
+
+static void
+sync_store(struct store *s)
+{
+	pthread_mutex_lock(&s->lock);
+	bool dirty = s->dirty;
+	int fd = s->active;
+	s->dirty = false;
+	pthread_mutex_unlock(&s->lock);
+
+	/* Only the writer seals the active segment, so `fd` stays. */
+	if (dirty) {
+		fdatasync(fd);
+		fdatasync(s->idx);
+	}
+
+	pthread_mutex_lock(&writer_lock);
+	writer_syncs += dirty;
+	pthread_mutex_unlock(&writer_lock);
+}
+
+/*
+ * The writer wakes up every commit interval, takes everything that has
+ * been appended since and writes it out store by store.
+ */
+
+static void *
+writer_main(void *arg)
+{
+	(void)arg;
+
+	long long last_sync = now_ns(), window = now_ns();
+	uint64_t window_bytes = 0;
+
+	for (;;) {
+		int ms = commit_interval;
+		nanosleep(&(struct timespec){
+			ms / 1000, ms % 1000 * 1000000L
+		}, NULL);
+
+		struct record *r = atomic_exchange(&queue, NULL), *fifo = NULL;
+
+		while (r) {
+			struct record *next = r->next;
+			r->next = fifo, fifo = r, r = next;
+		}
+
+		long long oldest = fifo ? fifo->queued : 0;
+		uint64_t bytes = 0;
+		size_t done = 0;
+
+		/* Split off the records of one store at a time. */
+		while (fifo) {
+			struct store *s = fifo->store;
+			struct record *mine = NULL, **tail = &mine;
+
+			for (struct record **p = &fifo; *p;) {
+				if ((*p)->store != s) {
+					p = &(*p)->next;
+					continue;
+				}
+				*tail = *p, tail = &(*p)->next;
+				*p = (*p)->next;
+			}
+
+			*tail = NULL;
+			bytes += write_records(s, mine);
+
+			if (sync_mode == STORE_SYNC_GROUP) sync_store(s);
+
+			while (mine) {
+				struct record *next = mine->next;
+				free(mine);
+				mine = next, done++;
+			}
+		}
+
+		pending -= done;
+		long long now = now_ns();
+
+		if (sync_mode == STORE_SYNC_PERIODIC
+		    && now - last_sync >= SYNC_PERIOD * 1000000LL) {
+			size_t n;
+			struct store **all = all_stores(&n);
+			for (size_t i = 0; i < n; i++) sync_store(all[i]);
+			free(all);
+			last_sync = now;
+		}
+
+		pthread_mutex_lock(&writer_lock);
+
+		if (done) {
+			writer_lag = now - oldest;
+			if (writer_lag > writer_max_lag)
+				writer_max_lag = writer_lag;
+		}
+
+		writer_bytes += bytes;
+		window_bytes += bytes;
+
+		if (now - window >= 1000000000LL) {
+			writer_rate = window_bytes * 1000000000LL
+				/ (now - window);
+			window = now, window_bytes = 0;
+		}
+
+		pthread_mutex_unlock(&writer_lock);
+	}
+
+	return NULL;
+}
+
+/*
+ * Reports on the writer: the number of records waiting to be written,
+ * how long the oldest record of the last batch waited (and the longest
+ * any has waited) in nanoseconds, the total bytes written and the rate
+ * over the last second, and the number of times it has synced a store.
+ */
+
+void
+store_writer_statistics(size_t *queued,
+                        long long *lag,
+                        long long *max_lag,
+                        uint64_t *bytes,
+                        uint64_t *rate,
+                        uint64_t *syncs)
+{
+	pthread_mutex_lock(&writer_lock);
+	*queued = pending;
+	*lag = writer_lag;
+	*max_lag = writer_max_lag;
+	*bytes = writer_bytes;
+	*rate = writer_rate;
+	*syncs = writer_syncs;
+	pthread_mutex_unlock(&writer_lock);
+}
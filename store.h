@@ -0,0 +1,65 @@
+/*
+ * An append-only message store. Each store is a directory holding
+ * segment files with the raw text of every record, one per line, and
+ * an index file of fixed-size entries giving the offset, length and
+ * time of each record. The index is memory-mapped, so opening a store
+ * costs the same whether it holds ten lines or ten million.
+ *
+ * A background compactor compresses segments once they are sealed
+ * and drops the oldest ones according to `store_configure`; the size
+ * limit applies to the segments, not the index. The
+ * records of dropped segments keep their numbers but can't be read.
+ *
+ * Appends don't touch the disk. A single writer thread shared by all
+ * stores collects them every commit interval and writes each store's
+ * batch with one write to its segment and one to its index.
+ */
+
+enum store_sync {
+	STORE_SYNC_NONE,
+	STORE_SYNC_PERIODIC,
+	STORE_SYNC_GROUP
+};
+
+struct store_entry {
+	uint64_t offset;
+	int64_t time;
+	uint32_t len;
+	uint32_t reserved;
+};
+
+/* A page of records read by `store_read_page`. Start it zeroed. */
+struct store_page {
+	char *data;
+	uint64_t offset;
+	size_t len;
+};
+
+struct store;
+
+struct store *store_open(const char *path);
+void store_close(struct store *s);
+void store_configure(struct store *s,
+                     uint64_t segment_size,
+                     int64_t max_age,
+                     uint64_t max_bytes);
+void store_durability(enum store_sync mode, int interval);
+int store_append(struct store *s,
+                 int64_t time,
+                 const char *text,
+                 size_t len);
+size_t store_count(struct store *s);
+size_t store_first(struct store *s);
+const struct store_entry *store_entry(struct store *s, size_t i);
+const char *store_read(struct store *s, size_t i, size_t *len);
+const char *store_read_page(struct store *s,
+                            size_t i,
+                            size_t *len,
+                            struct store_page *p);
+size_t store_seek(struct store *s, int64_t time);
+void store_writer_statistics(size_t *queued,
+                             long long *lag,
+                             long long *max_lag,
+                             uint64_t *bytes,
+                             uint64_t *rate,
+                             uint64_t *syncs);
@@ -0,0 +1,192 @@
+/*
+ * Checks what the paste worker reports to the channel. A one-shot HTTP
+ * listener stands in for the paste site and another socket for the IRC
+ * server. Build and run it from the top of the tree with
+ *
+ *     cc -I. -o paste-test test/paste.c paste.c net.c -lcurl -lpthread
+ *     ./paste-test
+ */
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include <curl/curl.h>
+
+#include "net.h"
+#include "paste.h"
+
+static int failed;
+
+/* Returns a socket listening on a free port of the loopback address. */
+
+static int
+listener(int *port)
+{
+	struct sockaddr_in addr = { 0 };
+	socklen_t len = sizeof addr;
+	int sock = socket(AF_INET, SOCK_STREAM, 0);
+
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	if (sock < 0
+	    || bind(sock, (void *)&addr, sizeof addr)
+	    || listen(sock, 1)
+	    || getsockname(sock, (void *)&addr, &len)) {
+		perror("listener");
+		exit(1);
+	}
+
+	*port = ntohs(addr.sin_port);
+	return sock;
+}
+
+struct site {
+	int sock;
+	const char *response;
+};
+
+/*
+ * Answers one request with the canned response. The request is read
+ * in full first so that curl doesn't see a reset.
+ */
+
+static void *
+site_main(void *data)
+{
+	struct site *s = data;
+	int conn = accept(s->sock, NULL, NULL);
+	char req[8192];
+	size_t len = 0;
+	char *body = NULL;
+
+	while (len < sizeof req - 1) {
+		ssize_t n = recv(conn, req + len, sizeof req - 1 - len, 0);
+		if (n <= 0) break;
+		len += n;
+		req[len] = 0;
+
+		if (!body && (body = strstr(req, "\r\n\r\n"))) body += 4;
+		if (!body) continue;
+
+		char *cl = strstr(req, "Content-Length:");
+		size_t want = cl ? strtoul(cl + 15, NULL, 10) : 0;
+		if (len - (body - req) >= want) break;
+	}
+
+	send(conn, s->response, strlen(s->response), 0);
+	close(conn);
+
+	return NULL;
+}
+
+static char *
+response(int status, const char *body)
+{
+	char *r = malloc(strlen(body) + 128);
+	sprintf(r, "HTTP/1.1 %d X\r\nContent-Length: %zu\r\n"
+	        "Connection: close\r\n\r\n%s", status, strlen(body), body);
+	return r;
+}
+
+/* Reads one line, including its \r\n, from the fake IRC server. */
+
+static void
+read_line(int sock, char *buf, size_t size)
+{
+	size_t len = 0;
+
+	while (len < size - 1 && recv(sock, buf + len, 1, 0) == 1)
+		if (buf[len++] == '\n') break;
+
+	buf[len] = 0;
+}
+
+static void
+check(struct net *net,
+      int irc,
+      const char *name,
+      int status,
+      const char *body,
+      int room,
+      const char *expect)
+{
+	struct site s;
+	int port;
+	char url[64], line[1024];
+	pthread_t thread;
+
+	s.sock = listener(&port);
+	s.response = response(status, body);
+	sprintf(url, "http://127.0.0.1:%d/", port);
+	pthread_create(&thread, NULL, site_main, &s);
+
+	paste_submit(net, "#chan", url, "hello\nworld", room);
+	read_line(irc, line, sizeof line);
+	pthread_join(thread, NULL);
+	fflush(stdout);
+
+	if (strcmp(line, expect)) {
+		printf("FAIL %s: got \"%s\"\n", name, line);
+		failed = 1;
+	} else {
+		printf("ok %s\n", name);
+	}
+
+	close(s.sock);
+	free((char *)s.response);
+}
+
+int
+main(void)
+{
+	curl_global_init(CURL_GLOBAL_ALL);
+
+	int port, server = listener(&port);
+	struct net *net = net_open("127.0.0.1", port);
+	int irc = accept(server, NULL, NULL);
+
+	if (!net || irc < 0) {
+		puts("couldn't connect to the fake server");
+		return 1;
+	}
+
+	/* A line that never comes is a failure, not a hang. */
+	struct timeval timeout = { .tv_sec = 10 };
+	setsockopt(irc, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof timeout);
+
+	check(net, irc, "success", 200, "http://ix.io/abc\n", 400,
+	      "PRIVMSG #chan :http://ix.io/abc\r\n");
+	check(net, irc, "error status", 500, "oops\n", 400,
+	      "PRIVMSG #chan :Paste failed.\r\n");
+
+	char *big = malloc(5001);
+	memset(big, 'a', 5000);
+	big[5000] = 0;
+	check(net, irc, "oversized response", 200, big, 400,
+	      "PRIVMSG #chan :Paste failed.\r\n");
+
+	/* A long first line is cut to the room it was given... */
+	char expect[NET_LINE_MAX + 1];
+	big[1000] = 0;
+	sprintf(expect, "PRIVMSG #chan :%.*s\r\n", 100, big);
+	check(net, irc, "long address", 200, big, 100, expect);
+
+	/* ...and never past what fits in a line to the server. */
+	sprintf(expect, "PRIVMSG #chan :%.*s\r\n",
+	        NET_LINE_MAX - (int)strlen("PRIVMSG #chan :\r\n"), big);
+	check(net, irc, "too much room", 200, big, 1000, expect);
+	free(big);
+
+	curl_global_cleanup();
+
+	return failed;
+}
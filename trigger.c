@@ -0,0 +1,282 @@
+#include <ctype.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include <kdg/kdgu.h>
+
+#include "trigger.h"
+#include "lisp/lisp.h"
+#include "lisp/regex.h"
+
+struct guard {
+	enum trigger_kind kind;
+	kdgu *arg;
+	ktre *re;
+	char *literal;          /* Case-folded; NULL if there is none. */
+};
+
+struct output {
+	int guard;
+	int next;
+};
+
+struct trigger {
+	struct guard *guard;
+	int num_guard;
+
+	/*
+	 * The automaton is a dense transition table of 256 entries per
+	 * state. Each state has a chain of outputs that includes the
+	 * outputs of every state on its failure path.
+	 */
+	int *next;
+	int *out;
+	int num_state, cap_state;
+
+	struct output *output;
+	int num_output, cap_output;
+
+	/* Guards that have to be checked on every message. */
+	int *always;
+	int num_always;
+};
+
+struct trigger *
+trigger_new(void)
+{
+	return calloc(1, sizeof (struct trigger));
+}
+
+void
+trigger_free(struct trigger *t)
+{
+	if (!t) return;
+
+	for (int i = 0; i < t->num_guard; i++) {
+		kdgu_free(t->guard[i].arg);
+		if (t->guard[i].re) ktre_free(t->guard[i].re);
+		free(t->guard[i].literal);
+	}
+
+	free(t->guard);
+	free(t->next);
+	free(t->out);
+	free(t->output);
+	free(t->always);
+	free(t);
+}
+
+/*
+ * Adds a guard to the index and returns its number, or -1 if the
+ * guard is a regex that doesn't compile. `opt` only applies to
+ * regexes.
+ */
+
+int
+trigger_add(struct trigger *t,
+            enum trigger_kind kind,
+            const kdgu *arg,
+            int opt)
+{
+	struct guard g = { kind, kdgu_copy(arg), NULL, NULL };
+
+	switch (kind) {
+	case TRIGGER_REGEX:
+		g.re = ktre_compile(g.arg, opt);
+		if (g.re->err) {
+			ktre_free(g.re);
+			kdgu_free(g.arg);
+			return -1;
+		}
+		g.literal = regex_literal(arg->s, arg->len);
+		break;
+	case TRIGGER_PREFIX:
+		if (!arg->len) break;
+		g.literal = malloc(arg->len + 1);
+		memcpy(g.literal, arg->s, arg->len);
+		g.literal[arg->len] = 0;
+		break;
+	case TRIGGER_NICK:
+		break;
+	}
+
+	/* The automaton works on case-folded text. */
+	for (char *c = g.literal; c && *c; c++)
+		*c = tolower((unsigned char)*c);
+
+	t->guard = realloc(t->guard,
+	                   (t->num_guard + 1) * sizeof *t->guard);
+	t->guard[t->num_guard] = g;
+
+	return t->num_guard++;
+}
+
+int
+trigger_count(struct trigger *t)
+{
+	return t->num_guard;
+}
+
+static int
+add_state(struct trigger *t)
+{
+	if (t->num_state == t->cap_state) {
+		t->cap_state = t->cap_state ? t->cap_state * 2 : 16;
+		t->next = realloc(t->next,
+		                  t->cap_state * 256 * sizeof *t->next);
+		t->out = realloc(t->out, t->cap_state * sizeof *t->out);
+	}
+
+	memset(t->next + t->num_state * 256,
+	       0xff,
+	       256 * sizeof *t->next);
+	t->out[t->num_state] = -1;
+
+	return t->num_state++;
+}
+
+static void
+add_output(struct trigger *t, int state, int guard)
+{
+	if (t->num_output == t->cap_output) {
+		t->cap_output = t->cap_output ? t->cap_output * 2 : 16;
+		t->output = realloc(t->output,
+		                    t->cap_output * sizeof *t->output);
+	}
+
+	t->output[t->num_output] = (struct output){
+		guard, t->out[state]
+	};
+	t->out[state] = t->num_output++;
+}
+
+/*
+ * Builds the automaton. This has to be called after the last guard
+ * has been added and before the first call to `trigger_match'.
+ */
+
+void
+trigger_build(struct trigger *t)
+{
+	add_state(t);
+
+	for (int i = 0; i < t->num_guard; i++) {
+		const char *lit = t->guard[i].literal;
+
+		if (!lit) {
+			t->always = realloc(t->always,
+			                    (t->num_always + 1)
+			                    * sizeof *t->always);
+			t->always[t->num_always++] = i;
+			continue;
+		}
+
+		int s = 0;
+
+		for (; *lit; lit++) {
+			unsigned char c = *lit;
+			if (t->next[s * 256 + c] < 0) {
+				int n = add_state(t);
+				t->next[s * 256 + c] = n;
+			}
+			s = t->next[s * 256 + c];
+		}
+
+		add_output(t, s, i);
+	}
+
+	/*
+	 * Fill in the failure transitions breadth-first, turning the
+	 * trie into a DFA. An output chain ends in the chain of the
+	 * state's failure state, which is already complete by then.
+	 */
+
+	int *fail = malloc(t->num_state * sizeof *fail);
+	int *queue = malloc(t->num_state * sizeof *queue);
+	int head = 0, tail = 0;
+
+	for (int c = 0; c < 256; c++) {
+		int n = t->next[c];
+		if (n < 0) {
+			t->next[c] = 0;
+		} else {
+			fail[n] = 0;
+			queue[tail++] = n;
+		}
+	}
+
+	while (head < tail) {
+		int s = queue[head++];
+		int *o = &t->out[s];
+
+		while (*o >= 0) o = &t->output[*o].next;
+		*o = t->out[fail[s]];
+
+		for (int c = 0; c < 256; c++) {
+			int n = t->next[s * 256 + c];
+			int f = t->next[fail[s] * 256 + c];
+
+			if (n < 0) {
+				t->next[s * 256 + c] = f;
+			} else {
+				fail[n] = f;
+				queue[tail++] = n;
+			}
+		}
+	}
+
+	free(fail);
+	free(queue);
+}
+
+static bool
+check(struct guard *g, const kdgu *nick, const kdgu *body)
+{
+	int **vec;
+
+	switch (g->kind) {
+	case TRIGGER_REGEX:
+		return ktre_exec(g->re, body, &vec);
+	case TRIGGER_PREFIX:
+		return body->len >= g->arg->len
+			&& !memcmp(body->s, g->arg->s, g->arg->len);
+	case TRIGGER_NICK:
+		return nick->len == g->arg->len
+			&& !strncasecmp(nick->s, g->arg->s, nick->len);
+	}
+
+	return false;
+}
+
+/*
+ * Sets `hit[i]' to whether the `i'th guard matches a message. `hit'
+ * must have room for `trigger_count(t)' entries.
+ */
+
+void
+trigger_match(struct trigger *t,
+              const kdgu *nick,
+              const kdgu *body,
+              bool *hit)
+{
+	/* Candidates are marked first and then checked exactly. */
+	bool *seen = calloc(t->num_guard + 1, sizeof *seen);
+	int s = 0;
+
+	for (unsigned i = 0; i < body->len; i++) {
+		s = t->next[s * 256 + tolower((unsigned char)body->s[i])];
+		for (int o = t->out[s]; o >= 0; o = t->output[o].next)
+			seen[t->output[o].guard] = true;
+	}
+
+	for (int i = 0; i < t->num_always; i++)
+		seen[t->always[i]] = true;
+
+	for (int i = 0; i < t->num_guard; i++)
+		hit[i] = seen[i] && check(&t->guard[i], nick, body);
+
+	free(seen);
+}
@@ -0,0 +1,27 @@
+/*
+ * A trigger index matches a message against many guards at once. All
+ * of the literal text that a guard needs in order to match is folded
+ * into one Aho-Corasick automaton, so a message is scanned once and
+ * only the guards whose literals turned up are checked exactly.
+ */
+
+enum trigger_kind {
+	TRIGGER_REGEX,          /* The body matches a regex.          */
+	TRIGGER_PREFIX,         /* The body begins with a string.     */
+	TRIGGER_NICK            /* The sender has a nick.             */
+};
+
+struct trigger;
+
+struct trigger *trigger_new(void);
+void trigger_free(struct trigger *t);
+int trigger_add(struct trigger *t,
+                enum trigger_kind kind,
+                const kdgu *arg,
+                int opt);
+void trigger_build(struct trigger *t);
+int trigger_count(struct trigger *t);
+void trigger_match(struct trigger *t,
+                   const kdgu *nick,
+                   const kdgu *body,
+                   bool *hit);
@@ -0,0 +1,251 @@
+#include <ctype.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "trigram.h"
+
+struct posting {
+	uint32_t key;           /* Zero for an empty slot.           */
+	uint32_t len, cap;
+	uint32_t *id;
+};
+
+struct trigram {
+	struct posting *slot;
+	size_t size, used;
+	size_t postings;
+
+	/* The time spent in `trigram_add`. */
+	long long update_ns;
+	size_t updates;
+};
+
+/* The key of the trigram at `s`. Keys are never zero. */
+#define KEY(s) ((uint32_t)tolower((unsigned char)(s)[0]) << 16 \
+                | (uint32_t)tolower((unsigned char)(s)[1]) << 8 \
+                | (uint32_t)tolower((unsigned char)(s)[2]) | 1u << 24)
+
+struct trigram *
+trigram_new(void)
+{
+	struct trigram *t = calloc(1, sizeof *t);
+	t->size = 1024;
+	t->slot = calloc(t->size, sizeof *t->slot);
+	return t;
+}
+
+void
+trigram_free(struct trigram *t)
+{
+	if (!t) return;
+	for (size_t i = 0; i < t->size; i++)
+		free(t->slot[i].id);
+	free(t->slot);
+	free(t);
+}
+
+static struct posting *
+lookup(struct trigram *t, uint32_t key)
+{
+	size_t i = (key * 2654435761u) & (t->size - 1);
+
+	while (t->slot[i].key && t->slot[i].key != key)
+		i = (i + 1) & (t->size - 1);
+
+	return &t->slot[i];
+}
+
+static void
+grow(struct trigram *t)
+{
+	struct posting *old = t->slot;
+	size_t size = t->size;
+
+	t->size *= 2;
+	t->slot = calloc(t->size, sizeof *t->slot);
+
+	for (size_t i = 0; i < size; i++)
+		if (old[i].key) *lookup(t, old[i].key) = old[i];
+
+	free(old);
+}
+
+static long long
+now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/*
+ * Adds the text `s` of `len` bytes under the number `id`, which must
+ * be greater than any number added before.
+ */
+
+void
+trigram_add(struct trigram *t,
+            uint32_t id,
+            const char *s,
+            size_t len)
+{
+	long long start = now_ns();
+
+	for (size_t i = 0; i + 3 <= len; i++) {
+		if (t->used * 2 >= t->size) grow(t);
+
+		struct posting *p = lookup(t, KEY(s + i));
+
+		if (!p->key) {
+			p->key = KEY(s + i);
+			t->used++;
+		}
+
+		/* A trigram may occur more than once in a text. */
+		if (p->len && p->id[p->len - 1] == id) continue;
+
+		if (p->len == p->cap) {
+			p->cap = p->cap ? p->cap * 2 : 4;
+			p->id = realloc(p->id, p->cap * sizeof *p->id);
+		}
+
+		p->id[p->len++] = id;
+		t->postings++;
+	}
+
+	t->update_ns += now_ns() - start;
+	t->updates++;
+}
+
+/*
+ * Returns the numbers, in increasing order, of the texts that contain
+ * every trigram of `lit` and sets `n` to how many there are. These
+ * are the only texts that can contain `lit`. Returns NULL if `lit` is
+ * too short to narrow anything down.
+ */
+
+uint32_t *
+trigram_query(struct trigram *t, const char *lit, size_t *n)
+{
+	size_t len = strlen(lit);
+	if (len < 3) return NULL;
+
+	/* Start from the rarest trigram. */
+	struct posting *rare = NULL;
+
+	for (size_t i = 0; i + 3 <= len; i++) {
+		struct posting *p = lookup(t, KEY(lit + i));
+		if (!rare || p->len < rare->len) rare = p;
+	}
+
+	uint32_t *ret = malloc((rare->len + 1) * sizeof *ret);
+	memcpy(ret, rare->id, rare->len * sizeof *ret);
+	*n = rare->len;
+
+	for (size_t i = 0; i + 3 <= len && *n; i++) {
+		struct posting *p = lookup(t, KEY(lit + i));
+		if (p == rare) continue;
+
+		/* Both lists are sorted, so intersect them in one pass. */
+		size_t k = 0, j = 0;
+
+		for (size_t m = 0; m < *n; m++) {
+			while (j < p->len && p->id[j] < ret[m]) j++;
+			if (j < p->len && p->id[j] == ret[m])
+				ret[k++] = ret[m];
+		}
+
+		*n = k;
+	}
+
+	return ret;
+}
+
+/*
+ * Moves everything in `src`, whose numbers must all be greater than
+ * those in `t`, into `t` and frees `src`.
+ */
+
+void
+trigram_merge(struct trigram *t, struct trigram *src)
+{
+	for (size_t i = 0; i < src->size; i++) {
+		struct posting *q = &src->slot[i];
+		if (!q->key) continue;
+
+		if (t->used * 2 >= t->size) grow(t);
+
+		struct posting *p = lookup(t, q->key);
+
+		if (!p->key) {
+			p->key = q->key;
+			t->used++;
+		}
+
+		if (p->len + q->len > p->cap) {
+			p->cap = p->len + q->len;
+			p->id = realloc(p->id, p->cap * sizeof *p->id);
+		}
+
+		memcpy(p->id + p->len, q->id, q->len * sizeof *q->id);
+		p->len += q->len;
+	}
+
+	t->postings += src->postings;
+	t->update_ns += src->update_ns;
+	t->updates += src->updates;
+	trigram_free(src);
+}
+
+/*
+ * Drops the numbers below `first` from every posting list. Trigrams
+ * left without texts keep their slots, which stay cheap to skip.
+ */
+
+void
+trigram_prune(struct trigram *t, uint32_t first)
+{
+	for (size_t i = 0; i < t->size; i++) {
+		struct posting *p = &t->slot[i];
+		uint32_t k = 0;
+
+		while (k < p->len && p->id[k] < first) k++;
+		if (!k) continue;
+
+		memmove(p->id, p->id + k, (p->len - k) * sizeof *p->id);
+		p->len -= k;
+		t->postings -= k;
+
+		/* Give back memory once the list has shrunk a lot. */
+		if (p->len < p->cap / 4) {
+			p->cap = p->len;
+			if (p->cap) {
+				p->id = realloc(p->id, p->cap * sizeof *p->id);
+			} else {
+				free(p->id);
+				p->id = NULL;
+			}
+		}
+	}
+}
+
+void
+trigram_statistics(struct trigram *t,
+                   size_t *trigrams,
+                   size_t *postings,
+                   size_t *bytes,
+                   long long *update_ns,
+                   size_t *updates)
+{
+	*trigrams = t->used;
+	*postings = t->postings;
+	*bytes = sizeof *t + t->size * sizeof *t->slot;
+
+	for (size_t i = 0; i < t->size; i++)
+		*bytes += t->slot[i].cap * sizeof *t->slot[i].id;
+
+	*update_ns = t->update_ns;
+	*updates = t->updates;
+}
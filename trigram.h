@@ -0,0 +1,25 @@
+/*
+ * An inverted index from the trigrams of some texts (case-folded) to
+ * the numbers of the texts that contain them. Texts must be added in
+ * increasing order of their numbers.
+ */
+
+struct trigram;
+
+struct trigram *trigram_new(void);
+void trigram_free(struct trigram *t);
+void trigram_add(struct trigram *t,
+                 uint32_t id,
+                 const char *s,
+                 size_t len);
+void trigram_merge(struct trigram *t, struct trigram *src);
+void trigram_prune(struct trigram *t, uint32_t first);
+uint32_t *trigram_query(struct trigram *t,
+                        const char *lit,
+                        size_t *n);
+void trigram_statistics(struct trigram *t,
+                        size_t *trigrams,
+                        size_t *postings,
+                        size_t *bytes,
+                        long long *update_ns,
+                        size_t *updates);